@@ -35,6 +35,38 @@
 #define JS_PROP_POOL_SIZE 30
 #endif
 
+#ifndef JS_ARRAY_POOL_SIZE
+#define JS_ARRAY_POOL_SIZE 64
+#endif
+
+#ifndef JS_CODE_SIZE
+#define JS_CODE_SIZE 512
+#endif
+
+#ifndef JS_PROP_INDEX_SIZE
+#define JS_PROP_INDEX_SIZE 0
+#endif
+
+#ifndef JS_PROP_INDEX_MIN
+#define JS_PROP_INDEX_MIN 8
+#endif
+
+#ifndef JS_CFUNC_SIZE
+#define JS_CFUNC_SIZE 16
+#endif
+
+#ifndef JS_HANDLE_SIZE
+#define JS_HANDLE_SIZE 16
+#endif
+
+#ifndef JS_GC_FWD_SIZE
+#define JS_GC_FWD_SIZE 8
+#endif
+
+#ifndef JS_ROOT_SIZE
+#define JS_ROOT_SIZE 8
+#endif
+
 #ifndef JS_ERROR_MESSAGE_SIZE
 #define JS_ERROR_MESSAGE_SIZE 40
 #endif
@@ -56,6 +88,7 @@ typedef long intptr_t;
 typedef __int64 int64_t;
 typedef unsigned __int64 uint64_t;
 typedef unsigned int uint32_t;
+typedef int int32_t;
 typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
 #define vsnprintf _vsnprintf
@@ -68,32 +101,89 @@ typedef unsigned char uint8_t;
 #endif
 
 typedef uint32_t jstok_t;           // JS token
+#ifdef JS_VAL64
+typedef uint64_t jsval_t;           // JS value placeholder
+typedef double jsnum_t;             // JS number
+typedef uint32_t ind_t;             // Pool index
+#else
 typedef uint32_t jsval_t;           // JS value placeholder
+#ifdef JS_NUM_INT32
+typedef int32_t jsnum_t;            // JS number
+#else
+typedef float jsnum_t;              // JS number
+#endif
+typedef uint16_t ind_t;             // Pool index
+#endif
 typedef uint16_t jslen_t;           // String length placeholder
 typedef void (*cfn_t)(void);        // Native C function, for exporting to JS
-typedef uint16_t ind_t;
 #define INVALID_INDEX ((ind_t) ~0)
 
+// Strictest alignment a VM needs. js_create_in() buffers must be aligned
+// as this union, e.g. declared as an array of it
+union js_align {
+  void *p;
+  jsval_t v;
+  double d;
+};
+
+// Pool sizes of a VM instance, see js_create_in()
+struct js_limits {
+  ind_t data_stack;  // Data stack size, in values
+  ind_t call_stack;  // Call stack size, in scopes
+  ind_t objs;        // Object pool size
+  ind_t props;       // Property pool size
+  ind_t strings;     // String pool size, in bytes
+  ind_t code;        // Bytecode pool size, in bytes
+  ind_t pindex;      // Property index size, if built with JS_PROP_INDEX_SIZE
+  ind_t elems;       // Array elements pool size, in values
+  ind_t cfuncs;      // Imported C functions table size
+  ind_t handles;     // Pointer and buffer handles table size
+};
+
 struct elk *js_create(void);        // Create instance
+struct elk *js_create_in(void *buf, unsigned long size,
+                         const struct js_limits *);  // Create in a buffer
 void js_destroy(struct elk *);      // Destroy instance
 jsval_t js_get_global(struct elk *);  // Get global namespace object
 jsval_t js_eval(struct elk *, const char *buf, int len);  // Evaluate expr
+jsval_t js_compile(struct elk *, const char *buf, int len);  // Compile code
+jsval_t js_run(struct elk *, jsval_t code);  // Run code made by js_compile()
+jsval_t js_call(struct elk *, jsval_t fn, const jsval_t *argv, int argc);
+struct cfunc;  // C function binding, see JS_CFUNC() and js_ffi()
+jsval_t js_import(struct elk *, jsval_t obj, const struct cfunc *, int n);
 jsval_t js_set(struct elk *, jsval_t obj, jsval_t k, jsval_t v);  // Set attr
+void js_gc(struct elk *);                                     // Collect garbage
+jsval_t js_root(struct elk *, jsval_t *v);  // Keep host variable alive on GC
+void js_unroot(struct elk *, jsval_t *v);   // Undo js_root()
 const char *js_stringify(struct elk *, jsval_t v);            // Stringify
-unsigned long js_size(void);                                  // Get VM size
+unsigned long js_size(const struct js_limits *);  // Get js_create_in() size
 
 // Converting from C type to jsval_t
 // Use JS_UNDEFINED, JS_NULL, JS_TRUE, JS_FALSE for other scalar types
 jsval_t js_mk_obj(struct elk *);
 jsval_t js_mk_str(struct elk *, const char *, int len);
-jsval_t js_mk_num(float value);
+jsval_t js_mk_num(jsnum_t value);
 jsval_t js_mk_js_func(struct elk *, const char *, int len);
 
 // Converting from jsval_t to C/C++ types
-float js_to_float(jsval_t v);                     // Unpack number
+jsnum_t js_to_float(jsval_t v);                   // Unpack number
 char *js_to_str(struct elk *, jsval_t, jslen_t *);  // Unpack string
 
+void *js_to_ptr(struct elk *, jsval_t);           // Unpack foreign pointer
+jsval_t js_mk_ptr(struct elk *, void *);          // Pack foreign pointer
+
+// Typed buffer element types, see js_mk_buf()
+enum {
+  JS_BUF_U8 = 1, JS_BUF_I8, JS_BUF_U16, JS_BUF_I16, JS_BUF_U32, JS_BUF_I32,
+  JS_BUF_F32
+};
+// Make a buffer of len elements over host memory, or, if ptr is NULL, over
+// zeroed memory in the VM string pool
+jsval_t js_mk_buf(struct elk *, void *ptr, int len, int type);
+
 #define js_to_float(v) tof(v)
+#define js_to_ptr(vm, v) toptr(vm, v)
+#define js_mk_ptr(vm, p) mk_ptr(vm, p)
 #define js_mk_str(vm, s, n) mk_str(vm, s, n)
 #define js_mk_obj(vm) mk_obj(vm)
 #define js_mk_num(v) tov(v)
@@ -119,11 +209,65 @@ char *js_to_str(struct elk *, jsval_t, jslen_t *);  // Unpack string
 //  seeeeeee|emmmmmmm|mmmmmmmm|mmmmmmmm
 //  11111111|1ttttvvv|vvvvvvvv|vvvvvvvv
 //    INF     TYPE     PAYLOAD
-
+//
+// Types 12..15 are not used, and hold small integers (SMI) instead:
+//  11111111|111iiiii|iiiiiiii|iiiiiiii
+//    INF    SMI  21-bit signed integer
+//
+// With JS_VAL64, values are 64-bit doubles, boxed the same way:
+//  seeeeeee|eeeemmmm|mmmmmmmm|...  11111111|1111tttt|48-bit payload
+// SMIs use a 50-bit payload, but hold int32 values only
+//
+// With JS_NUM_INT32, all numbers are integers, stored biased by 2^31 so
+// that they take the whole non-boxed space: from -2^31 to 0x7f7fffff
+
+#ifdef JS_VAL64
+typedef int64_t jsint_t;  // SMI value
+#define NAN_BOX ((jsval_t) 0xfff0 << 48)
+#define IS_FLOAT(v) (((v) &NAN_BOX) != NAN_BOX)
+#define MK_VAL(t, p) (NAN_BOX | ((jsval_t)(t) << 48) | (p))
+#define VAL_TYPE(v) ((js_type_t)(((v) >> 48) & 0x0f))
+#define VAL_PAYLOAD(v) ((v) & (((jsval_t) 1 << 48) - 1))
+#define NEG_ZERO ((jsval_t) 1 << 63)
+
+#define SMI_TAG ((jsval_t) 0xfffc << 48)
+#define SMI_SIGN ((jsint_t) 1 << 49)
+#define SMI_MIN (-(jsint_t) 0x7fffffff - 1)
+#define SMI_MAX ((jsint_t) 0x7fffffff)
+#else
+#ifdef JS_NUM_INT32
+typedef int64_t jsint_t;  // Integer math, wide enough not to overflow
+#else
+typedef long jsint_t;  // SMI value
+#endif
 #define IS_FLOAT(v) (((v) &0xff800000) != 0xff800000)
 #define MK_VAL(t, p) (0xff800000 | ((jsval_t)(t) << 19) | (p))
 #define VAL_TYPE(v) ((js_type_t)(((v) >> 19) & 0x0f))
 #define VAL_PAYLOAD(v) ((v) & ~0xfff80000)
+#define NEG_ZERO 0x80000000
+
+#define SMI_TAG 0xffe00000
+#define SMI_SIGN 0x00100000L
+#define SMI_MIN (-SMI_SIGN)
+#define SMI_MAX (SMI_SIGN - 1)
+#endif
+#ifdef JS_NUM_INT32
+#if defined(JS_VAL64)
+#error "JS_NUM_INT32 and JS_VAL64 cannot be used together"
+#endif
+#undef SMI_MIN
+#undef SMI_MAX
+#define NUM_BIAS 0x80000000
+#define SMI_MIN (-(jsint_t) 0x7fffffff - 1)
+#define SMI_MAX ((jsint_t) 0x7f7fffff)
+#define IS_SMI(v) IS_FLOAT(v)
+#define MK_SMI(i) ((jsval_t)(i) ^ NUM_BIAS)
+#define SMI_VAL(v) ((jsint_t)(int32_t)((v) ^ NUM_BIAS))
+#else
+#define IS_SMI(v) (((v) &SMI_TAG) == SMI_TAG)
+#define MK_SMI(i) (SMI_TAG | ((jsval_t)(i) & ~SMI_TAG))
+#define SMI_VAL(v) ((((jsint_t) ((v) & ~SMI_TAG)) ^ SMI_SIGN) - SMI_SIGN)
+#endif
 
 #define JS_UNDEFINED MK_VAL(JS_TYPE_UNDEFINED, 0)
 #define JS_ERROR MK_VAL(JS_TYPE_ERROR, 0)
@@ -133,7 +277,9 @@ char *js_to_str(struct elk *, jsval_t, jslen_t *);  // Unpack string
 
 #include <assert.h>
 #include <float.h>
+#ifndef JS_NUM_INT32
 #include <math.h>
+#endif
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -144,7 +290,7 @@ char *js_to_str(struct elk *, jsval_t, jslen_t *);  // Unpack string
 typedef enum {
   JS_TYPE_UNDEFINED, JS_TYPE_NULL, JS_TYPE_TRUE, JS_TYPE_FALSE,
   JS_TYPE_STRING, JS_TYPE_OBJECT, JS_TYPE_ARRAY, JS_TYPE_FUNCTION,
-  JS_TYPE_NUMBER, JS_TYPE_ERROR, JS_TYPE_C_FUNCTION, JS_TYPE_C_STRING,
+  JS_TYPE_NUMBER, JS_TYPE_ERROR, JS_TYPE_C_FUNCTION, JS_TYPE_POINTER,
 } js_type_t;
 // clang-format on
 
@@ -162,28 +308,132 @@ struct obj {
 };
 #define OBJ_ALLOCATED 1
 #define OBJ_CALL_ARGS 2  // This oject sits in the call stack, holds call args
+#define OBJ_INDEXED 4    // Object properties are in the property index
+#define OBJ_CACHED 8     // Object is in an inline cache, see OP_DOT
+#define OBJ_MARKED 16    // Object is reachable, see js_gc()
+#define OBJ_ARRAY 32     // Array: props is the offset of its elements block
+
+// Array elements block in the elements pool: a header, then cap values.
+// A block whose array has outgrown it, or has been freed, has no owner
+#define ARR_LEN 0  // Number of elements
+#define ARR_CAP 1  // Number of element slots
+#define ARR_OBJ 2  // Owner object, or INVALID_INDEX
+#define ARR_HDR 3  // Header size, in values
+// A C function value with this payload bit is push() of the array whose
+// object index is in the rest of the payload, see OP_DOT
+#define ARR_PUSH ((jsval_t) 1 << (sizeof(ind_t) * 8 + 2))
+
+// Property index slot. A free slot has obj == INVALID_INDEX
+struct pindex {
+  ind_t obj;   // Object index
+  ind_t prop;  // Property index
+  ind_t hash;  // Hash of the object index and the property key
+};
 
+#define FFI_MAX_ARGS_CNT 6
+union ffi_val;
+typedef void (*ffi_thunk_t)(cfn_t, union ffi_val *, const union ffi_val *);
+
+// C function binding. Bindings are never written, so a binding table can
+// be const, live in flash, and be shared by all VMs that import it
 struct cfunc {
   const char *name;   // function name
   const char *decl;   // Declaration of return values and arguments
   cfn_t fn;           // Pointer to C function
-  ind_t id;           // Function ID
-  struct cfunc *next;  // Next in a chain
 };
 
+// C function imported into a VM, with the declaration parsed once by
+// ffi_prepare(). Every VM keeps its own table of these
+struct ffi {
+  const struct cfunc *cf;       // Binding
+  ffi_thunk_t thunk;            // Call trampoline, or NULL on bad decl
+  const char *cbdecl;           // Callback declaration, from return type
+  uint8_t cbslot;               // Callback argument that takes fficbparam
+  uint8_t nargs;                // Number of arguments
+  char args[FFI_MAX_ARGS_CNT];  // Argument types
+};
+
+// Foreign memory handle: a pointer, or a typed buffer, see mk_ptr()
+struct handle {
+  void *ptr;     // Host memory, or NULL for buffers in the string pool
+  jsval_t str;   // String that holds the buffer data, if ptr is NULL
+  ind_t len;     // Buffer length in elements
+  uint8_t type;  // JS_BUF_*, H_PTR for plain pointers, or 0 if slot is free
+  uint8_t mark;  // Handle is reachable, see js_gc()
+};
+#define H_PTR 0xff
+
+// VM instance. Pools are laid out right after it, see js_create_in()
 struct elk {
   char error_message[JS_ERROR_MESSAGE_SIZE];
-  jsval_t data_stack[JS_DATA_STACK_SIZE];
-  jsval_t call_stack[JS_CALL_STACK_SIZE];
+  struct js_limits lim;                   // Pool sizes
+  bool allocated;                         // Created by js_create()
+  jsval_t *data_stack;                    // Data stack
+  jsval_t *call_stack;                    // Call stack
+  jsval_t *elems;                         // Array elements pool
+  ind_t elems_len;                        // Elements pool current length
   ind_t sp;                               // Points to the top of the data stack
   ind_t csp;                              // Points to the top of the call stack
+  ind_t fp;                               // First slot of the current frame
+  ind_t nruns;                            // Nested js_run() calls, see FFI m
   ind_t stringbuf_len;                    // String pool current length
-  struct obj objs[JS_OBJ_POOL_SIZE];      // Objects pool
-  struct prop props[JS_PROP_POOL_SIZE];   // Props pool
-  uint8_t stringbuf[JS_STRING_POOL_SIZE];    // String pool
-  struct cfunc *cfuncs;                      // Registered FFI-ed functions
-  ind_t cfunc_count;                         // Number of FFI-ed functions
+  struct obj *objs;                       // Objects pool
+  struct prop *props;                     // Props pool
+  ind_t *atoms;                           // Interned prop keys, see mk_key()
+  ind_t free_objs;                        // Free objects list, linked by props
+  ind_t free_props;                       // Free props list, linked by next
+  ind_t nobjs, nprops;                    // Number of allocated objs and props
+  ind_t gc_objs, gc_props, gc_strings;    // Pool usage that triggers GC
+  ind_t gc_elems;                         // Elements pool usage for GC
+  struct handle *handles;                 // Pointers and buffers
+  ind_t nhandles, gc_handles;             // Handles in use, and GC threshold
+  jsval_t *roots[JS_ROOT_SIZE];           // Host variables, see js_root()
+  ind_t nroots;                           // Number of host variables
+  uint32_t ic_epoch;                      // Bumped when cached obj is freed
+  uint32_t ic_hits, ic_misses;            // Inline cache statistics
+  uint8_t *stringbuf;                     // String pool
+  struct ffi *cfuncs;                     // Imported C functions
+  ind_t ncfuncs;                          // Number of imported C functions
+  ind_t code_len;                         // Bytecode pool current length
+  uint8_t *code;                          // Bytecode pool
+#if JS_PROP_INDEX_SIZE > 0
+  struct pindex *pindex;                  // Property index
+#endif
+};
+
+// js_compile() translates source code into bytecode, stored in vm->code.
+// An instruction is an opcode byte followed by operands, if any:
+//   n - name: a length byte followed by the name bytes
+//   l - long string: ind_t length followed by the string bytes
+//   v - jsval_t, t - 4-byte token, a - ind_t code offset, c - 1 byte
+//   g - variable inline cache: ind_t index of a global scope property,
+//       and 1 byte: the name bit in parameter masks, see lookup_ic()
+//   d - member inline cache: 4-byte epoch, ind_t object, ind_t property
+//   c - also a frame slot index, for OP_SLOT and OP_SLOTREF
+// clang-format off
+enum {
+  OP_RET, OP_PUSH /* v */, OP_STR /* n */, OP_GET /* n g */,
+  OP_REF /* n g */, OP_LET /* n */, OP_DOT /* n d */, OP_SETKEY /* n */,
+  OP_INDEX, OP_OBJ,
+  OP_FUNC /* function header */, OP_CALL /* c */, OP_OP /* t */, OP_DROP,
+  OP_JMP /* a */, OP_JZ /* a */, OP_JZ_KEEP /* a */, OP_JNZ_KEEP /* a */,
+  OP_ENTER, OP_LEAVE,
+  OP_SLOT /* c */, OP_SLOTREF /* c */, OP_INDEXREF, OP_ARR, OP_APPEND,
+  OP_LSTR /* l */,
 };
+// clang-format on
+#define IND_SIZE ((int) sizeof(ind_t))
+#define IC_GET_SIZE (IND_SIZE + 1)
+#define IC_DOT_SIZE (4 + 2 * IND_SIZE)
+
+// Function header, followed by the function body. A function value points
+// to the header. Top level code compiled by js_compile() has no source.
+#define FN_END 0                      // a: Offset past the end of function
+#define FN_SRC IND_SIZE               // a: Offset of the function source code
+#define FN_SRC_LEN (2 * IND_SIZE)     // a: Length of the function source code
+#define FN_MASK (3 * IND_SIZE)        // 4: Mask of parameter name hashes
+#define FN_NPARAMS (3 * IND_SIZE + 4) // c: Number of parameters
+#define FN_PARAMS (3 * IND_SIZE + 5)  // n: Parameter names, then the body
 
 #define ARRSIZE(x) ((sizeof(x) / sizeof((x)[0])))
 
@@ -209,54 +459,160 @@ static jsval_t vm_err(struct elk *vm, const char *fmt, ...) {
   return JS_ERROR;
 }
 
-union js_type_holder {
+// Bytecode operands are unaligned, thus accessed by memcpy
+static ind_t get_ind(const uint8_t *p) {
+  ind_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_ind(uint8_t *p, ind_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static jsval_t get_val(const uint8_t *p) {
   jsval_t v;
-  float f;
-};
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
 static js_type_t js_type(jsval_t v) {
-  return IS_FLOAT(v) ? JS_TYPE_NUMBER : VAL_TYPE(v);
+  return IS_FLOAT(v) || IS_SMI(v) ? JS_TYPE_NUMBER : VAL_TYPE(v);
+}
+
+#ifdef JS_NUM_INT32
+// Make a number. Values above SMI_MAX fall into the boxed space: saturate
+static jsval_t tov(jsnum_t n) {
+  return MK_SMI(n > SMI_MAX ? SMI_MAX : n);
+}
+
+static jsnum_t tof(jsval_t v) {
+  return (jsnum_t) SMI_VAL(v);
+}
+
+// Make a number from an integer
+static jsval_t mk_int(jsint_t i) {
+  return MK_SMI(i < SMI_MIN ? SMI_MIN : i > SMI_MAX ? SMI_MAX : i);
 }
+#else
+union js_type_holder {
+  jsval_t v;
+  jsnum_t f;
+};
 
-static jsval_t tov(float f) {
+// Make a number. Integers that fit are stored as SMI, except -0
+static jsval_t tov(jsnum_t f) {
   union js_type_holder u;
   u.f = f;
+  if (f >= SMI_MIN && f <= SMI_MAX && f == (jsnum_t)(jsint_t) f &&
+      u.v != NEG_ZERO) {
+    return MK_SMI((jsint_t) f);
+  }
   return u.v;
 }
 
-static float tof(jsval_t v) {
+static jsnum_t tof(jsval_t v) {
   union js_type_holder u;
+  if (IS_SMI(v)) return (jsnum_t) SMI_VAL(v);
   u.v = v;
   return u.f;
 }
 
+// Make a number from an integer
+static jsval_t mk_int(jsint_t i) {
+  return i >= SMI_MIN && i <= SMI_MAX ? MK_SMI(i) : tov((jsnum_t) i);
+}
+
+static jsval_t dtov(double d) {
+  return tov((jsnum_t) d);
+}
+#endif
+
+// Integer value of a number, for indexing. Numbers out of the int32
+// range, and NaN, saturate to values that fail index range checks
+static jsint_t toi(jsval_t v) {
+  jsnum_t f;
+  if (IS_SMI(v)) return SMI_VAL(v);
+  f = tof(v);
+  if (f >= 2147483647.0) return 2147483647;
+  if (!(f > -2147483648.0)) return -1;  // NaN, or too small
+  return (jsint_t) f;
+}
+
+#ifndef JS_NUM_INT32
+// Convert number to a 32-bit integer, like JS bitwise operators do: modulo
+// 2^32, and NaN or infinity is 0
+static int32_t toint32(jsnum_t f) {
+  double d = (double) f, q;
+  if (!(d > -9e18 && d < 9e18)) {
+    if (d != d || d - d != 0) return 0;  // NaN, or infinity
+    d = modf(d / 4294967296.0, &q) * 4294967296.0;  // Exact: 2^32 scaling
+  }
+  return (int32_t)(uint32_t)(int64_t) d;
+}
+#endif
+
+// 32-bit integer value of a number, for bitwise ops, buffers and FFI
+static int32_t toi32(jsval_t v) {
+#ifdef JS_NUM_INT32
+  return (int32_t) SMI_VAL(v);
+#else
+  return IS_SMI(v) ? (int32_t) SMI_VAL(v) : toint32(tof(v));
+#endif
+}
+
 static const char *js_typeof(jsval_t v) {
   const char *names[] = {"undefined", "null",   "true",   "false",
                          "string",    "object", "object", "function",
-                         "number",    "error",  "cfunc",  "cstring",
+                         "number",    "error",  "cfunc",  "pointer",
                          "?",         "?",      "?",      "?"};
   return names[js_type(v)];
 }
 
 static struct prop *firstprop(struct elk *vm, jsval_t obj);
+static jsval_t *arr_block(struct elk *vm, jsval_t arr);
+#if JS_PROP_INDEX_SIZE > 0
+static void pindex_del(struct elk *vm, ind_t obj);
+#endif
 static const char *_tos(struct elk *vm, jsval_t v, char *buf, int len) {
   js_type_t t = js_type(v);
   if (len <= 0 || buf == NULL) return buf;
   switch (t) {
     case JS_TYPE_NUMBER: {
+#ifdef JS_NUM_INT32
+      snprintf(buf, len, "%ld", (long) SMI_VAL(v));
+#else
       double f = tof(v), iv;
-      if (modf(f, &iv) == 0) {
-        snprintf(buf, len, "%ld", (long) f);
+      if (IS_SMI(v)) {
+        snprintf(buf, len, "%ld", (long) SMI_VAL(v));
+      } else if (modf(f, &iv) == 0 && fabs(f) < 1e21) {
+        snprintf(buf, len, "%.0f", f == 0 ? 0.0 : f);  // No -0
       } else {
+#ifdef JS_VAL64
+        snprintf(buf, len, "%.15g", f);
+        if (strtod(buf, NULL) != f) snprintf(buf, len, "%.17g", f);
+#else
         snprintf(buf, len, "%g", f);
+#endif
       }
+#endif
       break;
     }
     case JS_TYPE_STRING:
     case JS_TYPE_FUNCTION: {
       jslen_t n;
       const char *ptr = js_to_str(vm, v, &n);
-      snprintf(buf, len, "\"%.*s\"", n, ptr);
+      snprintf(buf, len, "\"%.*s\"", n, ptr == NULL ? "" : ptr);
       break;
     }
     case JS_TYPE_ERROR:
@@ -275,6 +631,17 @@ static const char *_tos(struct elk *vm, jsval_t v, char *buf, int len) {
       n += snprintf(buf + n, len - n, "}");
       break;
     }
+    case JS_TYPE_ARRAY: {
+      const jsval_t *a = arr_block(vm, v);
+      int n = snprintf(buf, len, "[");
+      ind_t i;
+      for (i = 0; i < a[ARR_LEN] && n < len; i++) {
+        if (i > 0) n += snprintf(buf + n, len - n, ",");
+        n += strlen(_tos(vm, a[ARR_HDR + i], buf + n, len - n));
+      }
+      if (n < len) snprintf(buf + n, len - n, "]");
+      break;
+    }
     default:
       snprintf(buf, len, "%s", js_typeof(v));
       break;
@@ -290,18 +657,21 @@ const char *tostr(struct elk *vm, jsval_t v) {
 #ifdef JS_DEBUG
 static void vm_dump(const struct elk *vm) {
   ind_t i;
-  printf("[VM] %8s[%4d]: ", "objs", (int) sizeof(vm->objs));
-  for (i = 0; i < ARRSIZE(vm->objs); i++) {
+  printf("[VM] %8s[%4d]: ", "objs", (int) (vm->lim.objs * sizeof(struct obj)));
+  for (i = 0; i < vm->lim.objs; i++) {
     putchar(vm->objs[i].flags ? 'v' : '-');
   }
   putchar('\n');
-  printf("[VM] %8s[%4d]: ", "props", (int) sizeof(vm->props));
-  for (i = 0; i < ARRSIZE(vm->props); i++) {
+  printf("[VM] %8s[%4d]: ", "props", (int) (vm->lim.props * sizeof(struct prop)));
+  for (i = 0; i < vm->lim.props; i++) {
     putchar(vm->props[i].flags ? 'v' : '-');
   }
   putchar('\n');
   printf("[VM] %8s: %d/%d\n", "strings", vm->stringbuf_len,
-         (int) sizeof(vm->stringbuf));
+         (int) vm->lim.strings);
+  printf("[VM] %8s: %d/%d\n", "code", vm->code_len, (int) vm->lim.code);
+  printf("[VM] %8s: %lu hits, %lu misses\n", "ic", (unsigned long) vm->ic_hits,
+         (unsigned long) vm->ic_misses);
   printf("[VM]  sp %d, csp %d, sb %d\n", vm->sp, vm->csp, vm->stringbuf_len);
 }
 #else
@@ -321,72 +691,8 @@ static void vm_swap(struct elk *vm) {
 }
 #endif
 
-static void abandon(struct elk *vm, jsval_t v) {
-  ind_t j;
-  js_type_t t = js_type(v);
-  DEBUG(("%s: %s\n", __func__, tostr(vm, v)));
-
-  if (t != JS_TYPE_OBJECT && t != JS_TYPE_STRING && t != JS_TYPE_FUNCTION)
-    return;
-
-  // If this value is still referenced, do nothing
-  for (j = 0; j < ARRSIZE(vm->props); j++) {
-    struct prop *prop = &vm->props[j];
-    if (prop->flags == 0) continue;
-    if (v == prop->key || v == prop->val) return;
-  }
-  // Look at the data stack too
-  for (j = 0; j < vm->sp; j++)
-    if (v == vm->data_stack[j]) return;
-
-  // vm_dump(vm);
-  if (t == JS_TYPE_OBJECT) {
-    ind_t i, obj_index = (ind_t) VAL_PAYLOAD(v);
-    struct obj *o = &vm->objs[obj_index];
-    o->flags = 0;  // Mark object free
-    i = o->props;
-    while (i != INVALID_INDEX) {  // Deallocate obj's properties too
-      struct prop *prop = &vm->props[i];
-      prop->flags = 0;  // Mark property free
-      assert(js_type(prop->key) == JS_TYPE_STRING);
-      abandon(vm, prop->key);
-      abandon(vm, prop->val);
-      i = prop->next;  // Point to the next property
-    }
-  } else if (t == JS_TYPE_STRING || t == JS_TYPE_FUNCTION) {
-    ind_t k, j, i = (ind_t) VAL_PAYLOAD(v);     // String begin
-    ind_t len = (ind_t)(vm->stringbuf[i] + 2);  // String length
-
-    // printf("abandoning %d %d [%s]\n", (int) i, (int) len, tostr(vm, v));
-    // Ok, not referenced, deallocate a string
-    if (i + len == sizeof(vm->stringbuf) || i + len == vm->stringbuf_len) {
-      // printf("shrink [%s]\n", tostr(vm, v));
-      vm->stringbuf[i] = 0;   // If we're the last string,
-      vm->stringbuf_len = i;  // shrink the buf immediately
-    } else {
-      vm->stringbuf[i + len - 1] = 'x';  // Mark string as dead
-      // Relocate all live strings to the beginning of the buffer
-      // printf("--> RELOC, %hu %hu\n", vm->stringbuf_len, len);
-      memmove(&vm->stringbuf[i], &vm->stringbuf[i + len], len);
-      assert(vm->stringbuf_len >= len);
-      vm->stringbuf_len = (ind_t)(vm->stringbuf_len - len);
-      for (j = 0; j < ARRSIZE(vm->props); j++) {
-        struct prop *prop = &vm->props[j];
-        if (prop->flags != 0) continue;
-        k = (ind_t) VAL_PAYLOAD(prop->key);
-        if (k > i) prop->key = MK_VAL(JS_TYPE_STRING, k - len);
-        if (js_type(prop->val) == JS_TYPE_STRING) {
-          k = (ind_t) VAL_PAYLOAD(prop->val);
-          if (k > i) prop->key = MK_VAL(JS_TYPE_STRING, k - len);
-        }
-      }
-    }
-    // printf("sbuflen %d\n", (int) vm->stringbuf_len);
-  }
-}
-
 static jsval_t vm_push(struct elk *vm, jsval_t v) {
-  if (vm->sp < ARRSIZE(vm->data_stack)) {
+  if (vm->sp < vm->lim.data_stack) {
     DEBUG(("%s: %s\n", __func__, tostr(vm, v)));
     vm->data_stack[vm->sp] = v;
     vm->sp++;
@@ -400,84 +706,531 @@ static jsval_t vm_drop(struct elk *vm) {
   if (vm->sp > 0) {
     DEBUG(("%s: %s\n", __func__, tostr(vm, *vm_top(vm))));
     vm->sp--;
-    abandon(vm, vm->data_stack[vm->sp]);
     return JS_TRUE;
   } else {
     return vm_err(vm, "stack underflow");
   }
 }
 
+// String pool entry is a length header, the string bytes, and a terminator
+// byte. Lengths below STR_LONG take one header byte. Longer strings have a
+// STR_LONG byte, followed by an unaligned jslen_t length
+#define STR_LONG 0xff
+#define STR_MAX ((jslen_t) ~0)  // Max string length
+
+// Return the bytes and the length of a string pool entry at offset ofs
+static uint8_t *str_data(struct elk *vm, ind_t ofs, jslen_t *len) {
+  uint8_t *p = &vm->stringbuf[ofs];
+  if (p[0] != STR_LONG) {
+    *len = p[0];
+    return p + 1;
+  }
+  memcpy(len, p + 1, sizeof(*len));
+  return p + 1 + sizeof(*len);
+}
+
+// Size of a string pool entry at offset ofs
+static ind_t str_size(struct elk *vm, ind_t ofs) {
+  jslen_t len;
+  uint8_t *p = str_data(vm, ofs, &len);
+  return (ind_t)(p - &vm->stringbuf[ofs] + len + 1);
+}
+
 static jsval_t mk_str(struct elk *vm, const char *p, int n) {
-  jslen_t len = n < 0 ? (jslen_t) strlen(p) : (jslen_t) n;
+  unsigned long len = n < 0 ? (unsigned long) strlen(p) : (unsigned long) n;
+  unsigned long hdr = len < STR_LONG ? 1 : 1 + sizeof(jslen_t);
   // printf("%s [%.*s], %d\n", __func__, n, p, (int) vm->stringbuf_len);
-  if (len > 0xff) {
+  if (len > STR_MAX) {
     return vm_err(vm, "string is too long");
-  } else if ((size_t) len + 2 > sizeof(vm->stringbuf) - vm->stringbuf_len) {
+  } else if (hdr + len + 1 >
+             (unsigned long) (vm->lim.strings - vm->stringbuf_len)) {
     return vm_err(vm, "string OOM");
   } else {
     jsval_t v = MK_VAL(JS_TYPE_STRING, vm->stringbuf_len);
-    vm->stringbuf[vm->stringbuf_len++] = (uint8_t)(len & 0xff);  // save length
-    if (p) memmove(&vm->stringbuf[vm->stringbuf_len], p, len);   // copy data
-    vm->stringbuf_len = (ind_t)(vm->stringbuf_len + len);
-    vm->stringbuf[vm->stringbuf_len++] = 0;  // nul-terminate
+    jslen_t n16 = (jslen_t) len;
+    uint8_t *s = &vm->stringbuf[vm->stringbuf_len];
+    s[0] = (uint8_t)(hdr == 1 ? len : STR_LONG);                // save length
+    if (hdr > 1) memcpy(s + 1, &n16, sizeof(n16));
+    if (p) memmove(s + hdr, p, len);                            // copy data
+    s[hdr + len] = 0;                                           // nul-terminate
+    vm->stringbuf_len = (ind_t)(vm->stringbuf_len + hdr + len + 1);
     return v;
   }
 }
 
+static ind_t strhash(ind_t seed, const char *ptr, jslen_t len) {
+  uint32_t h = 2166136261UL ^ seed;  // FNV-1a
+  while (len-- > 0) h = (h ^ (uint8_t) *ptr++) * 16777619UL;
+  return (ind_t)(h ^ (h >> 16));
+}
+
+// Property keys are atoms: all equal keys share one interned string, so
+// keys are compared as jsval_t. The atom table is a hash set of stringbuf
+// offsets of all keys, with open addressing and linear probing. It has
+// twice as many slots as there are props, thus never gets full.
+// Return a slot that holds an atom, or a free slot where it should go
+static ind_t atom_slot(struct elk *vm, const char *ptr, jslen_t len) {
+  ind_t i = (ind_t)(strhash(0, ptr, len) % (ind_t)(vm->lim.props * 2));
+  for (;;) {
+    ind_t a = vm->atoms[i];
+    jslen_t n;
+    const uint8_t *s;
+    if (a == INVALID_INDEX) break;
+    s = str_data(vm, a, &n);
+    if (n == len && memcmp(s, ptr, len) == 0) break;
+    if (++i >= (ind_t)(vm->lim.props * 2)) i = 0;
+  }
+  return i;
+}
+
+// Return an atom for the given string, or JS_UNDEFINED if no key has it
+static jsval_t find_atom(struct elk *vm, const char *ptr, jslen_t len) {
+  ind_t a = vm->atoms[atom_slot(vm, ptr, len)];
+  return a == INVALID_INDEX ? JS_UNDEFINED : MK_VAL(JS_TYPE_STRING, a);
+}
+
+// Return an atom for the given string. If there is none, make the string
+// an atom: copy it to the string pool if ptr is NULL, or use str as is
+static jsval_t intern(struct elk *vm, jsval_t str, const char *ptr,
+                      jslen_t len) {
+  ind_t i = atom_slot(vm, ptr, len), a = vm->atoms[i];
+  if (a != INVALID_INDEX) return MK_VAL(JS_TYPE_STRING, a);
+  if (str == JS_UNDEFINED && (str = mk_str(vm, ptr, len)) == JS_ERROR) {
+    return JS_ERROR;
+  }
+  vm->atoms[i] = (ind_t) VAL_PAYLOAD(str);
+  return str;
+}
+
+// Make a property key
+static jsval_t mk_key(struct elk *vm, const char *ptr, jslen_t len) {
+  return intern(vm, JS_UNDEFINED, ptr, len);
+}
+
+// Populate the atom table with the keys of all allocated props. Open
+// addressing cannot just free a slot, so that is how atoms get deleted
+static void atoms_rebuild(struct elk *vm) {
+  ind_t i;
+  for (i = 0; i < (ind_t)(vm->lim.props * 2); i++) vm->atoms[i] = INVALID_INDEX;
+  for (i = 0; i < vm->lim.props; i++) {
+    jslen_t len;
+    const char *ptr;
+    if (vm->props[i].flags == 0) continue;
+    ptr = js_to_str(vm, vm->props[i].key, &len);
+    vm->atoms[atom_slot(vm, ptr, len)] = (ind_t) VAL_PAYLOAD(vm->props[i].key);
+  }
+}
+
+// Ropes. Concatenation makes a rope node that refers to both halves,
+// rather than copying them, unless the result is no longer than a node.
+// A half shorter than a node is copied instead: into the other half, or
+// into the flat child of the other half's rope that is next to it, while
+// the copy stays within ROPE_LEAF bytes. Thus appends or prepends in a
+// loop cost a node per ROPE_LEAF bytes.
+// A node is a string pool entry flagged by STR_ROPE in its terminator byte.
+// It is flattened into a plain string when its bytes are needed, and then
+// refers to that string only
+#define STR_MARK 1  // Terminator byte flag: string is reachable, see js_gc()
+#define STR_ROPE 2  // Terminator byte flag: string is a rope node
+#define ROPE_SIZE ((int) (2 * sizeof(jsval_t) + sizeof(jslen_t)))
+#define ROPE_LEAF (4 * ROPE_SIZE)  // Longest copy for a short right half
+
+struct rope {
+  jsval_t left, right;  // Halves. Flattened node has right JS_UNDEFINED
+  jslen_t len;          // Total length
+};
+
+// Terminator byte of a string pool entry
+static uint8_t *str_end(struct elk *vm, jsval_t v) {
+  jslen_t len;
+  uint8_t *p = str_data(vm, (ind_t) VAL_PAYLOAD(v), &len);
+  return p + len;
+}
+
+static bool is_rope(struct elk *vm, jsval_t v) {
+  return js_type(v) == JS_TYPE_STRING && (*str_end(vm, v) & STR_ROPE);
+}
+
+// Rope nodes are unaligned, thus accessed by memcpy
+static void rope_get(struct elk *vm, jsval_t v, struct rope *r) {
+  const uint8_t *p = vm->stringbuf + VAL_PAYLOAD(v) + 1;
+  memcpy(&r->left, p, sizeof(r->left));
+  memcpy(&r->right, p + sizeof(jsval_t), sizeof(r->right));
+  memcpy(&r->len, p + 2 * sizeof(jsval_t), sizeof(r->len));
+}
+
+static void rope_put(struct elk *vm, jsval_t v, const struct rope *r) {
+  uint8_t *p = vm->stringbuf + VAL_PAYLOAD(v) + 1;
+  memcpy(p, &r->left, sizeof(r->left));
+  memcpy(p + sizeof(jsval_t), &r->right, sizeof(r->right));
+  memcpy(p + 2 * sizeof(jsval_t), &r->len, sizeof(r->len));
+}
+
+static jslen_t str_len(struct elk *vm, jsval_t v) {
+  struct rope r;
+  jslen_t len;
+  if (!is_rope(vm, v)) {
+    str_data(vm, (ind_t) VAL_PAYLOAD(v), &len);
+    return len;
+  }
+  rope_get(vm, v, &r);
+  return r.len;
+}
 
+// Copy string bytes to dst. Only the shorter half of a rope is copied
+// recursively, so the recursion depth is logarithmic
+static void str_copy(struct elk *vm, jsval_t v, char *dst) {
+  struct rope r;
+  const uint8_t *p;
+  jslen_t len;
+  while (is_rope(vm, v)) {
+    jslen_t n;
+    rope_get(vm, v, &r);
+    n = r.right == JS_UNDEFINED ? r.len : str_len(vm, r.left);
+    if (r.right == JS_UNDEFINED || n >= r.len - n) {
+      if (r.right != JS_UNDEFINED) str_copy(vm, r.right, dst + n);
+      v = r.left;
+    } else {
+      str_copy(vm, r.left, dst);
+      dst += n;
+      v = r.right;
+    }
+  }
+  p = str_data(vm, (ind_t) VAL_PAYLOAD(v), &len);
+  memcpy(dst, p, len);
+}
+
+// Return a plain string with the bytes of a rope
+static jsval_t str_flatten(struct elk *vm, jsval_t v) {
+  struct rope r;
+  jsval_t s;
+  if (!is_rope(vm, v)) return v;
+  rope_get(vm, v, &r);
+  if (r.right == JS_UNDEFINED) return r.left;
+  if ((s = mk_str(vm, NULL, r.len)) == JS_ERROR) return s;
+  str_copy(vm, v, (char *) str_data(vm, (ind_t) VAL_PAYLOAD(s), &r.len));
+  r.left = s;
+  r.right = JS_UNDEFINED;
+  rope_put(vm, v, &r);
+  return s;
+}
+
+// Return string bytes. A rope gets flattened, and if that fails, return NULL
 char *js_to_str(struct elk *vm, jsval_t v, jslen_t *len) {
-  uint8_t *p = vm->stringbuf + VAL_PAYLOAD(v);
-  if (len != NULL) *len = p[0];
-  return (char *) p + 1;
+  if (js_type(v) == JS_TYPE_FUNCTION) {
+    uint8_t *h = vm->code + VAL_PAYLOAD(v);  // Function source code
+    if (len != NULL) *len = get_ind(h + FN_SRC_LEN);
+    return (char *) vm->code + get_ind(h + FN_SRC);
+  } else {
+    jslen_t n;
+    char *p;
+    if (is_rope(vm, v) && (v = str_flatten(vm, v)) == JS_ERROR) {
+      if (len != NULL) *len = 0;
+      return NULL;
+    }
+    p = (char *) str_data(vm, (ind_t) VAL_PAYLOAD(v), &n);
+    if (len != NULL) *len = n;
+    return p;
+  }
 }
 
-static jsval_t js_concat(struct elk *vm, jsval_t v1, jsval_t v2) {
-  jsval_t v = JS_ERROR;
-  jslen_t n1, n2;
-  char *p1 = js_to_str(vm, v1, &n1), *p2 = js_to_str(vm, v2, &n2);
-  if ((v = mk_str(vm, NULL, n1 + n2)) != JS_ERROR) {
-    char *p = js_to_str(vm, v, NULL);
-    memmove(p, p1, n1);
-    memmove(p + n1, p2, n2);
+// Plain string with the bytes of v1 followed by the bytes of v2
+static jsval_t str_join(struct elk *vm, jsval_t v1, long n1, jsval_t v2,
+                        long n2) {
+  jsval_t v = mk_str(vm, NULL, (int) (n1 + n2));
+  if (v != JS_ERROR) {
+    jslen_t n;
+    char *p = (char *) str_data(vm, (ind_t) VAL_PAYLOAD(v), &n);
+    str_copy(vm, v1, p);
+    str_copy(vm, v2, p + n1);
   }
   return v;
 }
 
-#if 0
-static jsval_t mk_cfunc(struct elk *vm, ind_t i) {
-  ind_t i;
-  for (i = 0; i < ARRSIZE(vm->cfuncs); i++) {
-    if (vm->cfuncs[i].fn != NULL) continue;
-    return MK_VAL(JS_TYPE_C_FUNCTION, i);
+static jsval_t mk_rope(struct elk *vm, jsval_t v1, jsval_t v2, long len) {
+  jsval_t v = mk_str(vm, NULL, ROPE_SIZE);
+  if (v != JS_ERROR) {
+    struct rope r;
+    r.left = v1;
+    r.right = v2;
+    r.len = (jslen_t) len;
+    rope_put(vm, v, &r);
+    *str_end(vm, v) = STR_ROPE;
+  }
+  return v;
+}
+
+static jsval_t js_concat(struct elk *vm, jsval_t v1, jsval_t v2) {
+  long n, n1 = str_len(vm, v1), n2 = str_len(vm, v2);
+  struct rope r;
+  if (n2 == 0) return v1;
+  if (n1 == 0) return v2;
+  if (n1 + n2 > STR_MAX) return vm_err(vm, "string is too long");
+  if (n1 + n2 <= ROPE_SIZE ||
+      ((n1 < ROPE_SIZE || n2 < ROPE_SIZE) && n1 + n2 <= ROPE_LEAF)) {
+    return str_join(vm, v1, n1, v2, n2);
+  }
+  if (n2 < ROPE_SIZE && is_rope(vm, v1)) {
+    rope_get(vm, v1, &r);
+    if (r.right != JS_UNDEFINED && !is_rope(vm, r.right) &&
+        (n = str_len(vm, r.right)) + n2 <= ROPE_LEAF) {
+      jsval_t tail = str_join(vm, r.right, n, v2, n2);  // Grow the tail leaf
+      return tail == JS_ERROR ? tail : mk_rope(vm, r.left, tail, n1 + n2);
+    }
+  }
+  if (n1 < ROPE_SIZE && is_rope(vm, v2)) {
+    rope_get(vm, v2, &r);
+    if (r.right != JS_UNDEFINED && !is_rope(vm, r.left) &&
+        (n = str_len(vm, r.left)) + n1 <= ROPE_LEAF) {
+      jsval_t head = str_join(vm, v1, n1, r.left, n);  // Grow the head leaf
+      return head == JS_ERROR ? head : mk_rope(vm, head, r.right, n1 + n2);
+    }
+  }
+  return mk_rope(vm, v1, v2, n1 + n2);
+}
+
+// Foreign pointers and buffers. A value payload is an index in the VM's
+// handle table, and handles that are no longer reachable are freed by
+// js_gc(). Plain pointers share a handle per pointer. With JS_VAL64, plain
+// pointers fit into the payload, and only buffers take handles, marked
+// with the PTR_HANDLE payload bit. A NULL pointer is null
+#ifdef JS_VAL64
+#define PTR_HANDLE ((jsval_t) 1 << 47)
+#else
+#define PTR_HANDLE 0
+#endif
+
+static jsval_t mk_handle(struct elk *vm, void *p, jsval_t str, ind_t len,
+                         uint8_t type) {
+  ind_t i, slot = INVALID_INDEX;
+  for (i = 0; i < vm->lim.handles; i++) {
+    struct handle *h = &vm->handles[i];
+    if (type == H_PTR && h->type == H_PTR && h->ptr == p) {
+      return MK_VAL(JS_TYPE_POINTER, i | PTR_HANDLE);
+    }
+    if (h->type == 0 && slot == INVALID_INDEX) slot = i;
+  }
+  if (slot == INVALID_INDEX) return vm_err(vm, "handle OOM");
+  vm->handles[slot].ptr = p;
+  vm->handles[slot].str = str;
+  vm->handles[slot].len = len;
+  vm->handles[slot].type = type;
+  vm->nhandles++;
+  return MK_VAL(JS_TYPE_POINTER, slot | PTR_HANDLE);
+}
+
+static jsval_t mk_ptr(struct elk *vm, void *p) {
+#ifdef JS_VAL64
+  jsval_t a = (jsval_t) (size_t) p;
+  if (p == NULL) return JS_NULL;
+  if (a >= PTR_HANDLE) return vm_err(vm, "bad ptr");
+  return MK_VAL(JS_TYPE_POINTER, a);
+#else
+  return p == NULL ? JS_NULL : mk_handle(vm, p, JS_UNDEFINED, 0, H_PTR);
+#endif
+}
+
+// Handle of a pointer value, or NULL if the pointer is in the value itself
+static struct handle *tohandle(struct elk *vm, jsval_t v) {
+  if (js_type(v) != JS_TYPE_POINTER) return NULL;
+  if (PTR_HANDLE != 0 && !(VAL_PAYLOAD(v) & PTR_HANDLE)) return NULL;
+  return &vm->handles[VAL_PAYLOAD(v) & ~PTR_HANDLE];
+}
+
+static const uint8_t s_bufsizes[] = {0, 1, 1, 2, 2, 4, 4, 4};
+
+#ifdef JS_NUM_INT32
+#define BUF_MAX JS_BUF_I32  // No float math, thus no F32 buffers
+#else
+#define BUF_MAX JS_BUF_F32
+#endif
+
+jsval_t js_mk_buf(struct elk *vm, void *p, int len, int type) {
+  jsval_t str = JS_UNDEFINED;
+  jslen_t n;
+  if (type < JS_BUF_U8 || type > BUF_MAX || len < 0 || len > 0xffff) {
+    return vm_err(vm, "bad buffer");
+  }
+  if (p == NULL) {
+    if ((str = mk_str(vm, NULL, len * s_bufsizes[type])) == JS_ERROR) {
+      return JS_ERROR;
+    }
+    memset(str_data(vm, (ind_t) VAL_PAYLOAD(str), &n), 0,
+           (size_t) len * s_bufsizes[type]);
+  }
+  return mk_handle(vm, p, str, (ind_t) len, (uint8_t) type);
+}
+
+// Buffer handle of a value, or NULL
+static struct handle *tobuf(struct elk *vm, jsval_t v) {
+  struct handle *h = tohandle(vm, v);
+  return h == NULL || h->type == H_PTR ? NULL : h;
+}
+
+// Pointer value, or buffer data. Buffers in the string pool move on GC
+static void *toptr(struct elk *vm, jsval_t v) {
+  struct handle *h = tohandle(vm, v);
+  jslen_t len;
+  if (js_type(v) != JS_TYPE_POINTER) return NULL;
+  if (h == NULL) return (void *) (size_t) VAL_PAYLOAD(v);
+  if (h->ptr != NULL) return h->ptr;
+  return str_data(vm, (ind_t) VAL_PAYLOAD(h->str), &len);
+}
+
+// Buffer elements are read and written with memcpy: host memory, and data
+// in the string pool, may be unaligned
+static jsval_t buf_get(const uint8_t *p, int type) {
+  uint16_t u16;
+  uint32_t u32;
+#ifndef JS_NUM_INT32
+  float f;
+#endif
+  // clang-format off
+  switch (type) {
+    case JS_BUF_U8: return mk_int(p[0]);
+    case JS_BUF_I8: return mk_int((signed char) p[0]);
+    case JS_BUF_U16: memcpy(&u16, p, 2); return mk_int(u16);
+    case JS_BUF_I16: memcpy(&u16, p, 2); return mk_int((short) u16);
+#ifdef JS_NUM_INT32
+    case JS_BUF_U32: memcpy(&u32, p, 4); return mk_int((jsint_t) u32);
+    default: memcpy(&u32, p, 4); return mk_int((int32_t) u32);
+#else
+    case JS_BUF_U32: memcpy(&u32, p, 4);
+      return u32 > 0x7fffffff ? dtov((double) u32) : mk_int((jsint_t) u32);
+    case JS_BUF_I32: memcpy(&u32, p, 4); return mk_int((int32_t) u32);
+    default: memcpy(&f, p, 4); return dtov(f);
+#endif
   }
-  return vm_err(vm, "cfunc OOM");
+  // clang-format on
 }
+
+static void buf_set(uint8_t *p, int type, jsval_t v) {
+  uint16_t u16 = (uint16_t) toi32(v);
+  uint32_t u32 = (uint32_t) toi32(v);
+#ifndef JS_NUM_INT32
+  float f = (float) tof(v);
+#endif
+  // clang-format off
+  switch (type) {
+    case JS_BUF_U8: case JS_BUF_I8: p[0] = (uint8_t) u16; break;
+    case JS_BUF_U16: case JS_BUF_I16: memcpy(p, &u16, 2); break;
+#ifdef JS_NUM_INT32
+    default: memcpy(p, &u32, 4); break;
+#else
+    case JS_BUF_U32: case JS_BUF_I32: memcpy(p, &u32, 4); break;
+    default: memcpy(p, &f, 4); break;
 #endif
+  }
+  // clang-format on
+}
 
 static jsval_t mk_obj(struct elk *vm) {
-  ind_t i;
-  // Start iterating from 1, because object 0 is always a global object
-  for (i = 1; i < ARRSIZE(vm->objs); i++) {
-    if (vm->objs[i].flags != 0) continue;
-    vm->objs[i].flags = OBJ_ALLOCATED;
-    vm->objs[i].props = INVALID_INDEX;
-    return MK_VAL(JS_TYPE_OBJECT, i);
+  ind_t i = vm->free_objs;
+  if (i == INVALID_INDEX) return vm_err(vm, "obj OOM");
+  vm->free_objs = vm->objs[i].props;  // Take an object from the free list
+  vm->objs[i].flags = OBJ_ALLOCATED;
+  vm->objs[i].props = INVALID_INDEX;
+  vm->nobjs++;
+  return MK_VAL(JS_TYPE_OBJECT, i);
+}
+
+// Slide live element blocks down over the dead ones
+static void arr_compact(struct elk *vm) {
+  ind_t i = 0, dst = 0;
+  while (i < vm->elems_len) {
+    ind_t n = (ind_t)(ARR_HDR + vm->elems[i + ARR_CAP]);
+    ind_t oi = (ind_t) vm->elems[i + ARR_OBJ];
+    if (oi != INVALID_INDEX) {
+      if (i != dst) {
+        memmove(&vm->elems[dst], &vm->elems[i], n * sizeof(jsval_t));
+      }
+      vm->objs[oi].props = dst;
+      dst = (ind_t)(dst + n);
+    }
+    i = (ind_t)(i + n);
   }
-  return vm_err(vm, "obj OOM");
+  vm->elems_len = dst;
 }
 
-static jsval_t mk_func(struct elk *vm, const char *code, int len) {
-  jsval_t v = mk_str(vm, code, len);
-  if (v != JS_ERROR) {
-    v &= ~((jsval_t) 0x0f << 19);
-    v |= (jsval_t) JS_TYPE_FUNCTION << 19;
+// Allocate an element block of cap slots for array object oi. Return its
+// offset, or INVALID_INDEX if the pool is full. May move other blocks
+static ind_t arr_alloc(struct elk *vm, ind_t oi, unsigned long cap) {
+  ind_t b;
+  if (vm->elems_len + ARR_HDR + cap > vm->lim.elems) arr_compact(vm);
+  if (vm->elems_len + ARR_HDR + cap > vm->lim.elems) return INVALID_INDEX;
+  b = vm->elems_len;
+  vm->elems[b + ARR_LEN] = 0;
+  vm->elems[b + ARR_CAP] = (jsval_t) cap;
+  vm->elems[b + ARR_OBJ] = oi;
+  vm->elems_len = (ind_t)(b + ARR_HDR + cap);
+  return b;
+}
+
+static jsval_t mk_arr(struct elk *vm) {
+  jsval_t res;
+  ind_t oi, b;
+  TRY(mk_obj(vm));
+  oi = (ind_t) VAL_PAYLOAD(res);
+  if ((b = arr_alloc(vm, oi, 0)) == INVALID_INDEX) {
+    vm->objs[oi].flags = OBJ_ALLOCATED;  // GC frees it
+    return vm_err(vm, "array OOM");
+  }
+  vm->objs[oi].flags = OBJ_ALLOCATED | OBJ_ARRAY;
+  vm->objs[oi].props = b;
+  return MK_VAL(JS_TYPE_ARRAY, oi);
+}
+
+// Element block of an array
+static jsval_t *arr_block(struct elk *vm, jsval_t arr) {
+  return &vm->elems[vm->objs[VAL_PAYLOAD(arr)].props];
+}
+
+// Make room for n elements. Capacity doubles, so appends take amortized
+// constant time. The last block in the pool grows in place
+static jsval_t arr_reserve(struct elk *vm, jsval_t arr, unsigned long n) {
+  ind_t oi = (ind_t) VAL_PAYLOAD(arr), b = vm->objs[oi].props, nb;
+  unsigned long len = vm->elems[b + ARR_LEN], cap = vm->elems[b + ARR_CAP];
+  unsigned long want = cap < 2 ? 4 : cap * 2;
+  if (n <= cap) return JS_TRUE;
+  if (want < n) want = n;
+  if (b + ARR_HDR + cap == vm->elems_len && b + ARR_HDR + n <= vm->lim.elems) {
+    if (b + ARR_HDR + want > vm->lim.elems) want = vm->lim.elems - b - ARR_HDR;
+    vm->elems[b + ARR_CAP] = (jsval_t) want;
+    vm->elems_len = (ind_t)(b + ARR_HDR + want);
+    return JS_TRUE;
   }
+  nb = arr_alloc(vm, oi, want);
+  if (nb == INVALID_INDEX) nb = arr_alloc(vm, oi, n);
+  if (nb == INVALID_INDEX) return vm_err(vm, "array OOM");
+  b = vm->objs[oi].props;  // Compaction may have moved it
+  memcpy(&vm->elems[nb + ARR_HDR], &vm->elems[b + ARR_HDR],
+         len * sizeof(jsval_t));
+  vm->elems[nb + ARR_LEN] = (jsval_t) len;
+  vm->elems[b + ARR_OBJ] = INVALID_INDEX;
+  vm->objs[oi].props = nb;
+  return JS_TRUE;
+}
+
+// Store an element. Storing past the end grows the array, filling the gap
+// with undefined
+static jsval_t arr_set(struct elk *vm, jsval_t arr, jsint_t i, jsval_t v) {
+  jsval_t res, *a = arr_block(vm, arr);
+  unsigned long len = a[ARR_LEN];
+  if (i < 0) return vm_err(vm, "bad index");
+  if (i >= (jsint_t) vm->lim.elems) return vm_err(vm, "array OOM");
+  if ((unsigned long) i >= len) {
+    TRY(arr_reserve(vm, arr, (unsigned long) i + 1));
+    a = arr_block(vm, arr);
+    while (len < (unsigned long) i) a[ARR_HDR + len++] = JS_UNDEFINED;
+    a[ARR_LEN] = (jsval_t) i + 1;
+  }
+  a[ARR_HDR + i] = v;
   return v;
 }
 
 static jsval_t create_scope(struct elk *vm) {
   jsval_t scope;
-  if (vm->csp >= ARRSIZE(vm->call_stack) - 1) {
+  if (vm->csp >= vm->lim.call_stack - 1) {
     return vm_err(vm, "Call stack OOM");
   }
   if ((scope = mk_obj(vm)) == JS_ERROR) return JS_ERROR;
@@ -488,12 +1241,11 @@ static jsval_t create_scope(struct elk *vm) {
 }
 
 static jsval_t delete_scope(struct elk *vm) {
-  if (vm->csp <= 0 || vm->csp >= ARRSIZE(vm->call_stack)) {
+  if (vm->csp <= 0 || vm->csp >= vm->lim.call_stack) {
     return vm_err(vm, "Corrupt call stack");
   } else {
     DEBUG(("%s\n", __func__));
     vm->csp--;
-    abandon(vm, vm->call_stack[vm->csp]);
     return JS_TRUE;
   }
 }
@@ -501,70 +1253,260 @@ static jsval_t delete_scope(struct elk *vm) {
 static struct prop *firstprop(struct elk *vm, jsval_t obj) {
   ind_t obj_index = (ind_t) VAL_PAYLOAD(obj);
   struct obj *o = &vm->objs[obj_index];
-  if (obj_index >= ARRSIZE(vm->objs)) return NULL;
+  if (obj_index >= vm->lim.objs) return NULL;
   return o->props == INVALID_INDEX ? NULL : &vm->props[o->props];
 }
 
-// Lookup property in a given object
-static jsval_t *findprop(struct elk *vm, jsval_t obj, const char *ptr,
-                         jslen_t len) {
-  struct prop *prop = firstprop(vm, obj);
-  while (prop != NULL) {
-    jslen_t n = 0;
-    char *key = js_to_str(vm, prop->key, &n);
-    if (n == len && memcmp(key, ptr, n) == 0) return &prop->val;
-    prop = prop->next == INVALID_INDEX ? NULL : &vm->props[prop->next];
+#if JS_PROP_INDEX_SIZE > 0
+// Property index is a hash table shared by all objects that have at least
+// JS_PROP_INDEX_MIN properties, with open addressing and linear probing
+
+// Index slot of the object's property, or INVALID_INDEX
+static ind_t pindex_slot(struct elk *vm, ind_t obj, jsval_t key) {
+  jslen_t len;
+  const char *ptr = js_to_str(vm, key, &len);
+  ind_t n, h = strhash(obj, ptr, len), i = h % vm->lim.pindex;
+  for (n = 0; n < vm->lim.pindex; n++) {
+    struct pindex *e = &vm->pindex[i];
+    if (e->obj == INVALID_INDEX) break;
+    if (e->obj == obj && e->hash == h && vm->props[e->prop].key == key) {
+      return i;
+    }
+    if (++i >= vm->lim.pindex) i = 0;
   }
-  return NULL;
+  return INVALID_INDEX;
+}
+
+static struct prop *pindex_find(struct elk *vm, ind_t obj, jsval_t key) {
+  ind_t i = pindex_slot(vm, obj, key);
+  return i == INVALID_INDEX ? NULL : &vm->props[vm->pindex[i].prop];
 }
 
-// Lookup variable
-static jsval_t *lookup(struct elk *vm, const char *ptr, jslen_t len) {
+static bool pindex_add(struct elk *vm, ind_t obj, ind_t prop) {
+  jslen_t len;
+  const char *ptr = js_to_str(vm, vm->props[prop].key, &len);
+  ind_t n, h = strhash(obj, ptr, len), i = h % vm->lim.pindex;
+  for (n = 0; n < vm->lim.pindex; n++) {
+    struct pindex *e = &vm->pindex[i];
+    if (e->obj == INVALID_INDEX) {
+      e->obj = obj;
+      e->prop = prop;
+      e->hash = h;
+      return true;
+    }
+    if (++i >= vm->lim.pindex) i = 0;
+  }
+  return false;
+}
+
+// Put all object's properties in the index. If the index is full, drop them,
+// and let the object fall back to the linear property lookup
+static void pindex_build(struct elk *vm, ind_t obj) {
   ind_t i;
-  for (i = vm->csp; i > 0; i--) {
-    jsval_t scope = vm->call_stack[i - 1];
-    jsval_t *prop = findprop(vm, scope, ptr, len);
-    // printf(" lookup scope %d %s [%.*s] %p\n", (int) i, tostr(vm, scope),
-    //(int) len, ptr, prop);
-    if (prop != NULL) return prop;
+  vm->objs[obj].flags |= OBJ_INDEXED;
+  for (i = vm->objs[obj].props; i != INVALID_INDEX; i = vm->props[i].next) {
+    if (!pindex_add(vm, obj, i)) {
+      pindex_del(vm, obj);
+      break;
+    }
   }
-  return NULL;
 }
 
-// Lookup variable and push its value on stack on success
-static jsval_t lookup_and_push(struct elk *vm, const char *ptr, jslen_t len) {
-  jsval_t *vp = lookup(vm, ptr, len);
-  if (vp != NULL) return vm_push(vm, *vp);
-  return vm_err(vm, "[%.*s] undefined", len, ptr);
+// Free an index slot. Linear probing stops at a free slot, so the entries
+// after it in the same run, that would no longer be found, shift back
+static void pindex_free(struct elk *vm, ind_t i) {
+  ind_t n, j = i;
+  for (n = 0; n < vm->lim.pindex; n++) {
+    struct pindex *e;
+    ind_t home;
+    if (++j >= vm->lim.pindex) j = 0;
+    e = &vm->pindex[j];
+    if (e->obj == INVALID_INDEX) break;
+    home = e->hash % vm->lim.pindex;
+    if (i <= j ? home > i && home <= j : home > i || home <= j) continue;
+    vm->pindex[i] = *e;  // Home is at or before the free slot, move there
+    i = j;
+  }
+  vm->pindex[i].obj = INVALID_INDEX;
 }
 
-jsval_t js_set(struct elk *vm, jsval_t obj, jsval_t key, jsval_t val) {
-  if (js_type(obj) == JS_TYPE_OBJECT) {
-    jslen_t len;
-    const char *ptr = js_to_str(vm, key, &len);
-    struct prop *prop = firstprop(vm, obj);
-    while (prop != NULL) {
-      jslen_t n = 0;
-      char *key = js_to_str(vm, prop->key, &n);
-      if (n == len && memcmp(key, ptr, n) == 0) {
-        // The key already exists. Set the new value
-        jsval_t old = prop->val;
-        prop->val = val;
-        abandon(vm, old);
-        return JS_TRUE;
+// Remove object's properties from the index
+static void pindex_del(struct elk *vm, ind_t obj) {
+  ind_t i, p;
+  vm->objs[obj].flags = (ind_t)(vm->objs[obj].flags & ~OBJ_INDEXED);
+  for (p = vm->objs[obj].props; p != INVALID_INDEX; p = vm->props[p].next) {
+    i = pindex_slot(vm, obj, vm->props[p].key);
+    if (i != INVALID_INDEX) pindex_free(vm, i);
+  }
+}
+#endif
+
+// Lookup property in a given object by an atom key
+static jsval_t *findkey(struct elk *vm, jsval_t obj, jsval_t key) {
+  struct prop *prop = firstprop(vm, obj);
+#if JS_PROP_INDEX_SIZE > 0
+  if (prop != NULL && vm->objs[VAL_PAYLOAD(obj)].flags & OBJ_INDEXED) {
+    prop = pindex_find(vm, (ind_t) VAL_PAYLOAD(obj), key);
+    return prop == NULL ? NULL : &prop->val;
+  }
+#endif
+  while (prop != NULL) {
+    if (prop->key == key) return &prop->val;
+    prop = prop->next == INVALID_INDEX ? NULL : &vm->props[prop->next];
+  }
+  return NULL;
+}
+
+// Lookup property in a given object
+static jsval_t *findprop(struct elk *vm, jsval_t obj, const char *ptr,
+                         jslen_t len) {
+  jsval_t key = find_atom(vm, ptr, len);
+  return key == JS_UNDEFINED ? NULL : findkey(vm, obj, key);
+}
+
+// A function call has a frame in the call stack, rather than a scope
+// object. Frame is an SMI: the data stack index of its first slot. Slots
+// hold the call arguments, and the function value sits right below them.
+// Find the slot of a parameter by name
+static jsval_t *frame_find(struct elk *vm, jsval_t frame, const char *ptr,
+                           jslen_t len) {
+  ind_t i, base = (ind_t) SMI_VAL(frame);
+  ind_t h = (ind_t) VAL_PAYLOAD(vm->data_stack[base - 1]), pc = h + FN_PARAMS;
+  for (i = 0; i < vm->code[h + FN_NPARAMS]; i++) {
+    if (vm->code[pc] == len && memcmp(&vm->code[pc + 1], ptr, len) == 0) {
+      return &vm->data_stack[base + i];
+    }
+    pc = (ind_t)(pc + 1 + vm->code[pc]);
+  }
+  return NULL;
+}
+
+// Bit number of a name in the parameter mask, which tells names apart cheaply
+static uint8_t name_bit(const char *ptr, jslen_t len) {
+  return (uint8_t)(strhash(0, ptr, len) & 31);
+}
+
+// Names of frame's parameters, as an OR of their hash bits
+static uint32_t frame_mask(struct elk *vm, jsval_t frame) {
+  jsval_t f = vm->data_stack[SMI_VAL(frame) - 1];
+  return get32(&vm->code[VAL_PAYLOAD(f) + FN_MASK]);
+}
+
+// Lookup variable. Store call stack index of the scope that has it in *depth
+static jsval_t *lookup(struct elk *vm, const char *ptr, jslen_t len,
+                       ind_t *depth) {
+  ind_t i;
+  jsval_t key = find_atom(vm, ptr, len);  // Parameter names are not atoms
+  for (i = vm->csp; i > 0; i--) {
+    jsval_t scope = vm->call_stack[i - 1], *prop = NULL;
+    if (js_type(scope) != JS_TYPE_OBJECT) {
+      prop = frame_find(vm, scope, ptr, len);
+    } else if (key != JS_UNDEFINED) {
+      prop = findkey(vm, scope, key);
+    }
+    // printf(" lookup scope %d %s [%.*s] %p\n", (int) i, tostr(vm, scope),
+    //(int) len, ptr, prop);
+    if (prop != NULL) {
+      *depth = (ind_t)(i - 1);
+      return prop;
+    }
+  }
+  return NULL;
+}
+
+// Lookup variable using an inline cache, which holds a global scope
+// property found by this instruction last time, and the name hash bit.
+// Global scope properties are never freed, so the cache is valid unless an
+// inner scope has a variable with the same name. Scope objects are checked
+// by the atom key, and frames only when their parameter mask has the bit
+static jsval_t *lookup_ic(struct elk *vm, uint8_t *ic, const char *ptr,
+                          jslen_t len) {
+  ind_t i, pi = get_ind(ic), depth = 0;
+  jsval_t *v;
+  if (pi != INVALID_INDEX) {
+    uint32_t bit = (uint32_t) 1 << ic[IND_SIZE];
+    for (i = 1; i < vm->csp; i++) {
+      jsval_t scope = vm->call_stack[i];
+      if (js_type(scope) == JS_TYPE_OBJECT) {
+        if (findkey(vm, scope, vm->props[pi].key) != NULL) break;
+      } else if ((frame_mask(vm, scope) & bit) &&
+                 frame_find(vm, scope, ptr, len) != NULL) {
+        break;
       }
+    }
+    if (i >= vm->csp) {
+      vm->ic_hits++;
+      return &vm->props[pi].val;
+    }
+  }
+  vm->ic_misses++;
+  v = lookup(vm, ptr, len, &depth);
+  if (v != NULL && depth == 0) {
+    size_t off = offsetof(struct prop, val);
+    put_ind(ic, (ind_t)((struct prop *) ((char *) v - off) - vm->props));
+    ic[IND_SIZE] = name_bit(ptr, len);
+  }
+  return v;
+}
+
+// Lookup property using an inline cache, which holds an object and its
+// property found by this instruction last time. Properties are freed only
+// with their object, so the cache is valid until a cached object is freed
+static jsval_t *findprop_ic(struct elk *vm, uint8_t *ic, jsval_t obj,
+                            const char *ptr, jslen_t len) {
+  ind_t oi = (ind_t) VAL_PAYLOAD(obj), pi = get_ind(ic + 4 + IND_SIZE);
+  jsval_t *v;
+  if (get_ind(ic + 4) == oi && get32(ic) == vm->ic_epoch) {
+    vm->ic_hits++;
+    return &vm->props[pi].val;
+  }
+  vm->ic_misses++;
+  v = findprop(vm, obj, ptr, len);
+  if (v != NULL) {
+    size_t off = offsetof(struct prop, val);
+    vm->objs[oi].flags |= OBJ_CACHED;
+    put32(ic, vm->ic_epoch);
+    put_ind(ic + 4, oi);
+    put_ind(ic + 4 + IND_SIZE, (ind_t)((struct prop *) ((char *) v - off) - vm->props));
+  }
+  return v;
+}
+
+jsval_t js_set(struct elk *vm, jsval_t obj, jsval_t key, jsval_t val) {
+  if (js_type(obj) == JS_TYPE_OBJECT) {
+    jslen_t len;
+    const char *ptr;
+    jsval_t *v;
+    struct prop *prop = firstprop(vm, obj);
+    ind_t nprops = 1;  // Number of properties, including the new one
+    if ((key = str_flatten(vm, key)) == JS_ERROR) return key;  // Keys are flat
+    ptr = js_to_str(vm, key, &len);
+    key = intern(vm, key, ptr, len);
+    v = findkey(vm, obj, key);
+    if (v != NULL) {
+      // The key already exists. Set the new value
+      *v = val;
+      return JS_TRUE;
+    }
+    while (prop != NULL) {  // Find the last property
+      nprops++;
       if (prop->next == INVALID_INDEX) break;
       prop = &vm->props[prop->next];
     }
 
+    {
       ind_t i, obj_index = (ind_t) VAL_PAYLOAD(obj);
       struct obj *o = &vm->objs[obj_index];
-      if (obj_index >= ARRSIZE(vm->objs)) {
+      if (obj_index >= vm->lim.objs) {
         return vm_err(vm, "corrupt obj, index %x", obj_index);
       }
-      for (i = 0; i < ARRSIZE(vm->props); i++) {
+      if ((i = vm->free_props) == INVALID_INDEX) {
+        atoms_rebuild(vm);  // In case the key has been interned
+        return vm_err(vm, "props OOM");
+      }
+      {
         struct prop *p = &vm->props[i];
-        if (p->flags != 0) continue;
+        vm->free_props = p->next;  // Take a property from the free list
         p->flags = PROP_ALLOCATED;
 
         // Append property to the end of the property list
@@ -572,30 +1514,298 @@ jsval_t js_set(struct elk *vm, jsval_t obj, jsval_t key, jsval_t val) {
           p->next = o->props;
           o->props = i;
         } else {
-          assert(prop->next = INVALID_INDEX);
+          assert(prop->next == INVALID_INDEX);
           prop->next = i;
           p->next = INVALID_INDEX;
         }
 
         p->key = key;
         p->val = val;
-        DEBUG(("%s: prop %hu %s -> ", __func__, i, tostr(vm, key)));
+#if JS_PROP_INDEX_SIZE > 0
+        if (o->flags & OBJ_INDEXED) {
+          if (!pindex_add(vm, obj_index, i)) pindex_del(vm, obj_index);
+        } else if (nprops % JS_PROP_INDEX_MIN == 0 && vm->lim.pindex > 0) {
+          // Big enough to index. If the index is full, retry later
+          pindex_build(vm, obj_index);
+        }
+#endif
+        DEBUG(("%s: prop %d %s -> ", __func__, (int) i, tostr(vm, key)));
         DEBUG(("%s\n", tostr(vm, val)));
+        vm->nprops++;
         return JS_TRUE;
       }
-      return vm_err(vm, "props OOM");
     }
   } else {
     return vm_err(vm, "setting prop on non-object");
   }
 }
 
+/////////////////////////////////////// GC ///////////////////////////////////
+// Mark-and-sweep garbage collector. Roots are the call stack, which holds
+// the global object, and the data stack. Values are dropped without any
+// bookkeeping, and GC runs between VM instructions, when a pool usage
+// exceeds a threshold set by gc_limits(), or when an instruction runs out
+// of memory and is going to be run again. Host code must keep its values
+// reachable from the global object. Objects are marked by OBJ_MARKED,
+// strings by a non-zero nul terminator, which is reset by the compaction.
+static void gc_mark(struct elk *vm, jsval_t v);
+
+// Mark a string. Marking recurses into the shorter half of a rope only
+static void gc_mark_str(struct elk *vm, jsval_t v) {
+  for (;;) {
+    uint8_t *end = str_end(vm, v);
+    struct rope r;
+    jslen_t n;
+    if (*end & STR_MARK) return;
+    *end |= STR_MARK;
+    if (!(*end & STR_ROPE)) return;
+    rope_get(vm, v, &r);
+    n = r.right == JS_UNDEFINED ? r.len : str_len(vm, r.left);
+    if (r.right == JS_UNDEFINED || n >= r.len - n) {
+      if (r.right != JS_UNDEFINED) gc_mark(vm, r.right);
+      v = r.left;
+    } else {
+      gc_mark(vm, r.left);
+      v = r.right;
+    }
+  }
+}
+
+static void gc_mark(struct elk *vm, jsval_t v) {
+  struct handle *h = tohandle(vm, v);
+  if (js_type(v) == JS_TYPE_STRING) {
+    gc_mark_str(vm, v);
+  } else if (js_type(v) == JS_TYPE_OBJECT) {
+    struct obj *o = &vm->objs[VAL_PAYLOAD(v)];
+    ind_t i;
+    if (o->flags & OBJ_MARKED) return;
+    o->flags |= OBJ_MARKED;
+    for (i = o->props; i != INVALID_INDEX; i = vm->props[i].next) {
+      gc_mark(vm, vm->props[i].key);
+      gc_mark(vm, vm->props[i].val);
+    }
+  } else if (js_type(v) == JS_TYPE_ARRAY) {
+    struct obj *o = &vm->objs[VAL_PAYLOAD(v)];
+    ind_t i;
+    if (o->flags & OBJ_MARKED) return;
+    o->flags |= OBJ_MARKED;
+    for (i = 0; i < vm->elems[o->props + ARR_LEN]; i++) {
+      gc_mark(vm, vm->elems[o->props + ARR_HDR + i]);
+    }
+  } else if (h != NULL) {
+    h->mark = 1;
+    if (h->ptr == NULL) gc_mark(vm, h->str);
+  } else if (js_type(v) == JS_TYPE_C_FUNCTION && (VAL_PAYLOAD(v) & ARR_PUSH)) {
+    gc_mark(vm, MK_VAL(JS_TYPE_ARRAY, VAL_PAYLOAD(v) & ~ARR_PUSH));
+  }
+}
+
+// Put object and its properties on the free lists. An array's element
+// block is left for arr_compact()
+static void free_obj(struct elk *vm, ind_t obj_index) {
+  struct obj *o = &vm->objs[obj_index];
+  ind_t i = o->props;
+  if (o->flags & OBJ_ARRAY) {
+    vm->elems[i + ARR_OBJ] = INVALID_INDEX;
+    i = INVALID_INDEX;
+  }
+#if JS_PROP_INDEX_SIZE > 0
+  if (o->flags & OBJ_INDEXED) pindex_del(vm, obj_index);
+#endif
+  if (o->flags & OBJ_CACHED) vm->ic_epoch++;  // Invalidate inline caches
+  o->flags = 0;
+  o->props = vm->free_objs;
+  vm->free_objs = obj_index;
+  vm->nobjs--;
+  while (i != INVALID_INDEX) {
+    struct prop *prop = &vm->props[i];
+    ind_t next = prop->next;
+    prop->flags = 0;
+    prop->next = vm->free_props;
+    vm->free_props = i;
+    vm->nprops--;
+    i = next;
+  }
+}
+
+struct strfwd {
+  ind_t ofs;    // Old offset of the first string that moves by this shift
+  ind_t shift;  // Distance it moves down
+};
+
+// Apply forwarding table to a string reference
+static void str_forward1(const struct strfwd *fwd, int n, ind_t end,
+                         jsval_t *v) {
+  ind_t ofs = (ind_t) VAL_PAYLOAD(*v);
+  int lo = 0, hi = n - 1;
+  if (js_type(*v) != JS_TYPE_STRING || ofs < fwd[0].ofs || ofs >= end) return;
+  while (lo < hi) {  // Find the last entry with fwd[lo].ofs <= ofs
+    int mid = (lo + hi + 1) / 2;
+    if (fwd[mid].ofs <= ofs) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  *v = MK_VAL(JS_TYPE_STRING, ofs - fwd[lo].shift);
+}
+
+// Apply forwarding table to the halves of rope nodes in [from, to)
+static void str_forward_ropes(struct elk *vm, const struct strfwd *fwd, int n,
+                              ind_t end, ind_t from, ind_t to) {
+  while (from < to) {
+    jsval_t v = MK_VAL(JS_TYPE_STRING, from);
+    if (*str_end(vm, v) & STR_ROPE) {
+      struct rope r;
+      rope_get(vm, v, &r);
+      str_forward1(fwd, n, end, &r.left);
+      str_forward1(fwd, n, end, &r.right);
+      rope_put(vm, v, &r);
+    }
+    from = (ind_t)(from + str_size(vm, from));
+  }
+}
+
+// Apply forwarding table to all string references in [fwd[0].ofs, end).
+// References below fwd[0].ofs are either already fixed, or do not move.
+// Strings below dst are compacted, and strings from end on are not yet
+static void str_forward(struct elk *vm, struct strfwd *fwd, int n,
+                        ind_t end, ind_t dst) {
+  ind_t i;
+  if (n == 0) return;
+  str_forward_ropes(vm, fwd, n, end, 0, dst);
+  str_forward_ropes(vm, fwd, n, end, end, vm->stringbuf_len);
+  for (i = 0; i < vm->lim.props; i++) {
+    if (vm->props[i].flags == 0) continue;
+    str_forward1(fwd, n, end, &vm->props[i].key);
+    str_forward1(fwd, n, end, &vm->props[i].val);
+  }
+  for (i = 0; i < vm->sp; i++) str_forward1(fwd, n, end, &vm->data_stack[i]);
+  for (i = 0; i < vm->nroots; i++) str_forward1(fwd, n, end, vm->roots[i]);
+  for (i = 0; i < vm->elems_len;
+       i = (ind_t)(i + ARR_HDR + vm->elems[i + ARR_CAP])) {
+    ind_t j;
+    if ((ind_t) vm->elems[i + ARR_OBJ] == INVALID_INDEX) continue;
+    for (j = 0; j < vm->elems[i + ARR_LEN]; j++) {
+      str_forward1(fwd, n, end, &vm->elems[i + ARR_HDR + j]);
+    }
+  }
+  for (i = 0; i < vm->lim.handles; i++) {
+    struct handle *h = &vm->handles[i];
+    if (h->type != 0 && h->ptr == NULL) str_forward1(fwd, n, end, &h->str);
+  }
+}
+
+// Slide live strings down over the dead ones, and unmark them. Every run
+// of strings that moves by the same distance gets a forwarding table entry.
+// When the table is full, references are fixed up to that point, and the
+// compaction carries on with an empty table
+static void str_compact(struct elk *vm) {
+  struct strfwd fwd[JS_GC_FWD_SIZE];
+  ind_t i = 0, dst = 0;
+  int n = 0;
+  while (i < vm->stringbuf_len) {
+    ind_t len = str_size(vm, i);
+    uint8_t *end = &vm->stringbuf[i + len - 1];
+    if (*end & STR_MARK) {
+      *end = (uint8_t)(*end & ~STR_MARK);
+      if (i != dst) {
+        if (n == 0 || fwd[n - 1].shift != i - dst) {
+          if (n == (int) ARRSIZE(fwd)) {
+            str_forward(vm, fwd, n, i, dst);
+            n = 0;
+          }
+          fwd[n].ofs = i;
+          fwd[n].shift = (ind_t)(i - dst);
+          n++;
+        }
+        memmove(&vm->stringbuf[dst], &vm->stringbuf[i], len);
+      }
+      dst = (ind_t)(dst + len);
+    }
+    i = (ind_t)(i + len);
+  }
+  str_forward(vm, fwd, n, i, dst);
+  vm->stringbuf_len = dst;
+}
+
+// GC threshold of a pool: let the usage double, but grow by at least 1/8
+// of the pool, so that a pool full of live data is not collected on every
+// instruction. A full pool is collected when an allocation fails instead
+static ind_t gc_threshold(unsigned long used, unsigned long size) {
+  unsigned long n = used * 2;
+  if (n < used + size / 8) n = used + size / 8;
+  return (ind_t)(n < size ? n : size);
+}
+
+static void gc_limits(struct elk *vm) {
+  vm->gc_objs = gc_threshold(vm->nobjs, vm->lim.objs);
+  vm->gc_props = gc_threshold(vm->nprops, vm->lim.props);
+  vm->gc_strings = gc_threshold(vm->stringbuf_len, vm->lim.strings);
+  vm->gc_handles = gc_threshold(vm->nhandles, vm->lim.handles);
+  vm->gc_elems = gc_threshold(vm->elems_len, vm->lim.elems);
+}
+
+void js_gc(struct elk *vm) {
+  ind_t i;
+  DEBUG(("%s: %d objs, %d props, %d string bytes\n", __func__, vm->nobjs,
+         vm->nprops, vm->stringbuf_len));
+  for (i = 0; i < vm->csp; i++) gc_mark(vm, vm->call_stack[i]);
+  for (i = 0; i < vm->sp; i++) gc_mark(vm, vm->data_stack[i]);
+  for (i = 0; i < vm->nroots; i++) gc_mark(vm, *vm->roots[i]);
+  for (i = 0; i < vm->lim.objs; i++) {
+    struct obj *o = &vm->objs[i];
+    if (o->flags & OBJ_MARKED) {
+      o->flags = (ind_t)(o->flags & ~OBJ_MARKED);
+    } else if (o->flags != 0) {
+      free_obj(vm, i);
+    }
+  }
+  for (i = 0; i < vm->lim.handles; i++) {
+    struct handle *h = &vm->handles[i];
+    if (h->mark) {
+      h->mark = 0;
+    } else if (h->type != 0) {
+      h->type = 0;
+      vm->nhandles--;
+    }
+  }
+  arr_compact(vm);
+  str_compact(vm);
+  atoms_rebuild(vm);
+  gc_limits(vm);
+}
+
+// Host variables that hold values across js_eval() and js_gc() calls.
+// GC keeps their values, and updates them when their strings move
+jsval_t js_root(struct elk *vm, jsval_t *v) {
+  if (vm->nroots >= JS_ROOT_SIZE) return vm_err(vm, "roots OOM");
+  vm->roots[vm->nroots++] = v;
+  return JS_TRUE;
+}
+
+void js_unroot(struct elk *vm, jsval_t *v) {
+  ind_t i;
+  for (i = vm->nroots; i > 0; i--) {
+    if (vm->roots[i - 1] == v) {
+      vm->roots[i - 1] = vm->roots[--vm->nroots];
+      break;
+    }
+  }
+}
+
+static bool gc_needed(struct elk *vm) {
+  return vm->nhandles > vm->gc_handles || vm->nobjs > vm->gc_objs ||
+         vm->nprops > vm->gc_props || vm->stringbuf_len > vm->gc_strings ||
+         vm->elems_len > vm->gc_elems;
+}
+
 static int is_true(struct elk *vm, jsval_t v) {
-  jslen_t len;
   js_type_t t = js_type(v);
-  return t == JS_TYPE_TRUE || (t == JS_TYPE_NUMBER && tof(v) != 0.0) ||
-         t == JS_TYPE_OBJECT || t == JS_TYPE_FUNCTION ||
-         (t == JS_TYPE_STRING && js_to_str(vm, v, &len) && len > 0);
+  return t == JS_TYPE_TRUE || (t == JS_TYPE_NUMBER && tof(v) != 0) ||
+         t == JS_TYPE_OBJECT || t == JS_TYPE_ARRAY || t == JS_TYPE_FUNCTION ||
+         t == JS_TYPE_POINTER ||
+         (t == JS_TYPE_STRING && str_len(vm, v) > 0);
 }
 
 ////////////////////////////////// TOKENIZER /////////////////////////////////
@@ -603,7 +1813,13 @@ static int is_true(struct elk *vm, jsval_t v) {
 struct tok {
   jstok_t tok, len;
   const char *ptr;
-  float num_value;
+  jsnum_t num_value;
+};
+
+struct ptok {      // Pre-lexed token, see tokenize()
+  jstok_t tok;
+  ind_t ofs, len;  // Token position in the source code
+  jsnum_t num_value;
 };
 
 struct parser {
@@ -614,7 +1830,14 @@ struct parser {
   int line_no;            // Line number
   jstok_t prev_tok;       // Previous token, for prefix increment / decrement
   struct tok tok;         // Parsed token
-  int noexec;             // Parse only, do not execute
+  struct tok peek;        // Next token, if has_peek is set, see lookahead()
+  bool has_peek;          // Next token is lexed and buffered in peek
+  struct ptok *toks;      // Pre-lexed tokens, or NULL to lex on the fly
+  ind_t ntoks, tok_idx;   // Number of pre-lexed tokens, next token index
+  ind_t ref;              // Offset of the last OP_GET, for assignments
+  ind_t fn;               // Header of the function being compiled, or invalid
+  int nparams;            // Its number of parameters, which have frame slots
+  bool shadowed;          // A parameter is shadowed by a block-level `let`
   struct elk *vm;
 };
 
@@ -635,96 +1858,115 @@ enum {
 };
 // clang-format on
 
-// We're not relying on the target libc ctype, as it may incorrectly
-// handle negative arguments, e.g. isspace(-1).
-static int js_is_space(int c) {
-  return c == ' ' || c == '\r' || c == '\n' || c == '\t' || c == '\f' ||
-         c == '\v';
-}
+// Character classes. We're not relying on the target libc ctype, as it may
+// incorrectly handle negative arguments, e.g. isspace(-1).
+#define C_SPACE 1  // Whitespace
+#define C_DIGIT 2  // 0..9
+#define C_IDENT 4  // Identifier start: a letter, _ or $
+#define C_PUNCT 8  // Single-char token: ,.:;{}[]()?
+#define C_OP 16    // Operator start, see getop()
+#define C_QUOTE 32
 
-static int js_is_digit(int c) {
-  return c >= '0' && c <= '9';
-}
+// clang-format off
+static const uint8_t s_cc[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,                 // 00
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                 // 10
+  1, 16, 32, 0, 4, 16, 16, 32, 8, 8, 16, 16, 8, 16, 8, 16,        //  !"#$%&'()*+,-./
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 8, 8, 16, 16, 16, 8,              // 0123456789:;<=>?
+  0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,                 // @ABCDEFGHIJKLMNO
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 8, 0, 8, 16, 4,                // PQRSTUVWXYZ[\]^_
+  0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,                 // `abcdefghijklmno
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 8, 16, 8, 16, 0,               // pqrstuvwxyz{|}~
+};
+// clang-format on
 
-static int js_is_alpha(int c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+static int js_is_space(int c) {
+  return s_cc[(uint8_t) c] & C_SPACE;
 }
 
-static int js_is_ident(int c) {
-  return c == '_' || c == '$' || js_is_alpha(c);
+// Can an operator token `tok` be extended with the char `c`. Together with
+// getop() this is a maximal munch DFA: the states are the token prefixes
+static int opnext(jstok_t tok, int c) {
+  // clang-format off
+  switch (tok) {
+    case '&': case '|': case '<': case '>': case '-': case '+':
+      return c == '=' || c == (int) tok;
+    case '^': case '~': case '%': case '/': case '*': case '=': case '!':
+    case DT('<', '<'): case DT('=', '='): case DT('!', '='):
+    case TT('>', '>', '>'):
+      return c == '=';
+    case DT('>', '>'):
+      return c == '=' || c == '>';
+  }
+  // clang-format on
+  return 0;
 }
 
-// Try to parse a token that can take one or two chars.
-static int longtok(struct parser *p, const char *first_chars,
-                   const char *second_chars) {
-  if (strchr(first_chars, p->pos[0]) == NULL) return TOK_EOF;
-  if (p->pos + 1 < p->end && p->pos[1] != '\0' &&
-      strchr(second_chars, p->pos[1]) != NULL) {
+static jstok_t getop(struct parser *p) {
+  jstok_t tok = (uint8_t) p->pos[0];
+  while (p->pos + 1 < p->end && opnext(tok, p->pos[1])) {
+    tok = tok << 8 | (uint8_t) p->pos[1];
     p->tok.len++;
     p->pos++;
-    return p->pos[-1] << 8 | p->pos[0];
   }
-  return p->pos[0];
-}
-
-// Try to parse a token that takes exactly 3 chars.
-static int longtok3(struct parser *p, char a, char b, char c) {
-  if (p->pos + 2 < p->end && p->pos[0] == a && p->pos[1] == b &&
-      p->pos[2] == c) {
-    p->tok.len += 2;
-    p->pos += 2;
-    return ((jstok_t) p->pos[-2] << 16) | ((jstok_t) p->pos[-1] << 8) |
-           p->pos[0];
-  }
-  return TOK_EOF;
-}
-
-// Try to parse a token that takes exactly 4 chars.
-static int longtok4(struct parser *p, char a, char b, char c, char d) {
-  if (p->pos + 3 < p->end && p->pos[0] == a && p->pos[1] == b &&
-      p->pos[2] == c && p->pos[3] == d) {
-    p->tok.len += 3;
-    p->pos += 3;
-    return ((jstok_t) p->pos[-3] << 24) | ((jstok_t) p->pos[-2] << 16) |
-           ((jstok_t) p->pos[-1] << 8) | p->pos[0];
-  }
-  return TOK_EOF;
+  return tok;
 }
 
 static int getnum(struct parser *p) {
   if (p->pos[0] == '0' && p->pos[1] == 'x') {
     // MSVC6 strtod cannot parse 0x... numbers, thus this ugly workaround.
-    p->tok.num_value = (float) strtoul(p->pos + 2, (char **) &p->pos, 16);
+#ifdef JS_NUM_INT32
+    unsigned long n = strtoul(p->pos + 2, (char **) &p->pos, 16);
+    p->tok.num_value = (jsnum_t)(n > SMI_MAX ? SMI_MAX : n);
+  } else {
+    unsigned long n = strtoul(p->pos, (char **) &p->pos, 10);
+    p->tok.num_value = (jsnum_t)(n > SMI_MAX ? SMI_MAX : n);
+    if (p->pos[0] == '.') p->pos++;  // Drop the fraction
+    while (s_cc[(uint8_t) p->pos[0]] & C_DIGIT) p->pos++;
+#else
+    p->tok.num_value = (jsnum_t) strtoul(p->pos + 2, (char **) &p->pos, 16);
   } else {
-    p->tok.num_value = (float) strtod(p->pos, (char **) &p->pos);
+    p->tok.num_value = (jsnum_t) strtod(p->pos, (char **) &p->pos);
+#endif
   }
   p->tok.len = p->pos - p->tok.ptr;
   p->pos--;
   return TOK_NUM;
 }
 
+// Keywords, in the TOK_BREAK .. TOK_UNDEFINED order
+static const char *s_keywords[] = {
+    "break",     "case",   "catch", "continue",   "debugger", "default",
+    "delete",    "do",     "else",  "false",      "finally",  "for",
+    "function",  "if",     "in",    "instanceof", "new",      "null",
+    "return",    "switch", "this",  "throw",      "true",     "try",
+    "typeof",    "var",    "void",  "while",      "with",     "let",
+    "undefined"};
+
+// Perfect hash of the keywords: KWHASH() gives each one a distinct slot,
+// which holds its index + 1. Regenerate the table when adding a keyword
+#define KWHASH(s, len) \
+  (((uint8_t)(s)[0] * 13 + (uint8_t)(s)[1] * 7 + (len) * 15) & 63)
+static const uint8_t s_kwhash[64] = {
+    6,  0, 0,  27, 0,  18, 17, 22, 4,  0,  0,  0, 0,  25, 0,  5,
+    0,  9, 26, 0,  0,  0,  0,  0,  0,  13, 0,  0, 0,  0,  0,  0,
+    10, 0, 0,  1,  12, 0,  29, 19, 0,  0,  2,  0, 30, 16, 28, 24,
+    0,  7, 20, 0,  0,  15, 11, 0,  21, 3,  31, 8, 0,  14, 23, 0,
+};
+
 static int is_reserved_word_token(const char *s, int len) {
-  const char *reserved[] = {
-      "break",     "case",   "catch", "continue",   "debugger", "default",
-      "delete",    "do",     "else",  "false",      "finally",  "for",
-      "function",  "if",     "in",    "instanceof", "new",      "null",
-      "return",    "switch", "this",  "throw",      "true",     "try",
-      "typeof",    "var",    "void",  "while",      "with",     "let",
-      "undefined", NULL};
   int i;
-  if (!js_is_alpha(s[0])) return 0;
-  for (i = 0; reserved[i] != NULL; i++) {
-    if (len == (int) strlen(reserved[i]) && strncmp(s, reserved[i], len) == 0)
-      return i + 1;
-  }
-  return 0;
+  if (len < 2 || len > 10) return 0;
+  i = s_kwhash[KWHASH(s, len)];
+  if (i == 0 || strncmp(s, s_keywords[i - 1], len) != 0) return 0;
+  return s_keywords[i - 1][len] == '\0' ? i : 0;
 }
 
 static int getident(struct parser *p) {
-  while (js_is_ident(p->pos[0]) || js_is_digit(p->pos[0])) p->pos++;
+  while (s_cc[(uint8_t) p->pos[0]] & (C_IDENT | C_DIGIT)) p->pos++;
   p->tok.len = p->pos - p->tok.ptr;
   p->pos--;
-  return TOK_IDENT;
+  return TOK_IDENT + is_reserved_word_token(p->tok.ptr, p->tok.len);
 }
 
 static int getstr(struct parser *p) {
@@ -767,42 +2009,25 @@ static void skip_spaces_and_comments(struct parser *p) {
   } while (pos < p->pos);
 }
 
-static jstok_t pnext(struct parser *p) {
-  jstok_t tmp, tok = TOK_INVALID;
+static jstok_t lex(struct parser *p) {
+  jstok_t tok = TOK_INVALID;
 
   skip_spaces_and_comments(p);
   p->tok.ptr = p->pos;
   p->tok.len = 1;
 
-  if (p->pos[0] == '\0' || p->pos >= p->end) tok = TOK_EOF;
-  if (js_is_digit(p->pos[0])) {
-    tok = getnum(p);
-  } else if (p->pos[0] == '\'' || p->pos[0] == '"') {
-    tok = getstr(p);
-  } else if (js_is_ident(p->pos[0])) {
-    tok = getident(p);
-    // NOTE: getident() has side effects on `p`, and `is_reserved_word_token()`
-    // relies on them. Since in C the order of evaluation of the operands is
-    // undefined, `is_reserved_word_token()` should be called in a separate
-    // statement.
-    tok += is_reserved_word_token(p->tok.ptr, p->tok.len);
-  } else if (strchr(",.:;{}[]()?", p->pos[0]) != NULL) {
-    tok = p->pos[0];
-  } else if ((tmp = longtok3(p, '<', '<', '=')) != TOK_EOF ||
-             (tmp = longtok3(p, '>', '>', '=')) != TOK_EOF ||
-             (tmp = longtok4(p, '>', '>', '>', '=')) != TOK_EOF ||
-             (tmp = longtok3(p, '>', '>', '>')) != TOK_EOF ||
-             (tmp = longtok3(p, '=', '=', '=')) != TOK_EOF ||
-             (tmp = longtok3(p, '!', '=', '=')) != TOK_EOF ||
-             (tmp = longtok(p, "&", "&=")) != TOK_EOF ||
-             (tmp = longtok(p, "|", "|=")) != TOK_EOF ||
-             (tmp = longtok(p, "<", "<=")) != TOK_EOF ||
-             (tmp = longtok(p, ">", ">=")) != TOK_EOF ||
-             (tmp = longtok(p, "-", "-=")) != TOK_EOF ||
-             (tmp = longtok(p, "+", "+=")) != TOK_EOF) {
-    tok = tmp;
-  } else if ((tmp = longtok(p, "^~+-%/*<>=!|&", "=")) != TOK_EOF) {
-    tok = tmp;
+  if (p->pos[0] == '\0' || p->pos >= p->end) {
+    tok = TOK_EOF;
+  } else {
+    // clang-format off
+    switch (s_cc[(uint8_t) p->pos[0]]) {
+      case C_DIGIT: tok = getnum(p); break;
+      case C_QUOTE: tok = getstr(p); break;
+      case C_IDENT: tok = getident(p); break;
+      case C_PUNCT: tok = (uint8_t) p->pos[0]; break;
+      case C_OP: tok = getop(p); break;
+    }
+    // clang-format on
   }
   if (p->pos < p->end && p->pos[0] != '\0') p->pos++;
   p->prev_tok = p->tok.tok;
@@ -812,7 +2037,62 @@ static jstok_t pnext(struct parser *p) {
   return p->tok.tok;
 }
 
-////////////////////////////////// PARSER /////////////////////////////////
+// Lex the whole source once into a token array, placed at the free end of
+// the bytecode pool, so that the compiler walks an array instead of chars.
+// If there is not enough room, tokens are lexed on the fly.
+static void tokenize(struct parser *p) {
+  struct elk *vm = p->vm;
+  uint8_t *start = &vm->code[vm->code_len], *end = vm->code + vm->lim.code;
+  struct ptok *t = (struct ptok *) (end - (size_t) end % sizeof(jsval_t));
+  struct parser tmp = *p;
+  ind_t n = 0;
+  if (p->end - p->buf > 0xffff) return;
+  for (;;) {  // Tokens are stored backwards, the first one is the last
+    if ((size_t)((uint8_t *) t - start) < sizeof(*t) || n == 0xffff) return;
+    t--;
+    t->tok = lex(&tmp);
+    t->ofs = (ind_t)(tmp.tok.ptr - p->buf);
+    t->len = (ind_t) tmp.tok.len;
+    t->num_value = tmp.tok.num_value;
+    n++;
+    if (t->tok == TOK_EOF) break;
+  }
+  p->toks = t;
+  p->ntoks = n;
+  p->tok_idx = 0;
+}
+
+// Bytecode needs the space taken by the token array. Drop the array, and
+// continue lexing on the fly from the current token
+static void untokenize(struct parser *p) {
+  jstok_t prev = p->prev_tok;
+  p->toks = NULL;
+  if (p->tok_idx == 0) return;  // Nothing consumed yet, pos is still at buf
+  p->pos = p->tok.ptr - (p->tok.tok == TOK_STR ? 1 : 0);
+  lex(p);
+  p->prev_tok = prev;
+}
+
+static jstok_t pnext(struct parser *p) {
+  const struct ptok *t;
+  if (p->toks == NULL && p->has_peek) {
+    p->has_peek = false;
+    p->prev_tok = p->tok.tok;
+    p->tok = p->peek;
+    return p->tok.tok;
+  }
+  if (p->toks == NULL) return lex(p);
+  t = &p->toks[p->ntoks - 1 - p->tok_idx];
+  if (t->tok != TOK_EOF) p->tok_idx++;
+  p->prev_tok = p->tok.tok;
+  p->tok.tok = t->tok;
+  p->tok.ptr = p->buf + t->ofs;
+  p->tok.len = t->len;
+  p->tok.num_value = t->num_value;
+  return p->tok.tok;
+}
+
+////////////////////////////////// COMPILER /////////////////////////////////
 
 static jsval_t parse_statement_list(struct parser *p, jstok_t endtok);
 static jsval_t parse_expr(struct parser *p);
@@ -830,317 +2110,313 @@ static struct parser mk_parser(struct elk *vm, const char *buf, int len) {
   p.line_no = 1;
   p.buf = p.pos = buf;
   p.end = buf + len;
+  p.ref = INVALID_INDEX;
+  p.fn = INVALID_INDEX;
   p.vm = vm;
   return p;
 }
 
-// clang-format off
-static jstok_t s_assign_ops[] = {
-  '=', DT('+', '='), DT('-', '='),  DT('*', '='), DT('/', '='), DT('%', '='),
-  TT('<', '<', '='), TT('>', '>', '='), QT('>', '>', '>', '='), DT('&', '='),
-  DT('^', '='), DT('|', '='), TOK_EOF
-};
-// clang-format on
-static jstok_t s_postfix_ops[] = {DT('+', '+'), DT('-', '-'), TOK_EOF};
-static jstok_t s_unary_ops[] = {'!',        '~', DT('+', '+'), DT('-', '-'),
-                                TOK_TYPEOF, '-', '+',          TOK_EOF};
-static jstok_t s_equality_ops[] = {
-    DT('=', '+'), DT('!', '='), TT('=', '=', '='), TT('=', '=', '='), TOK_EOF};
-static jstok_t s_cmp_ops[] = {DT('<', '='), '<', '>', DT('>', '='), TOK_EOF};
+// Append bytes to the bytecode pool. If ptr is NULL, append zeroes
+static jsval_t emit(struct parser *p, const void *ptr, int len) {
+  struct elk *vm = p->vm;
+  if (p->toks != NULL &&
+      (size_t)((uint8_t *) p->toks - vm->code) < (size_t) vm->code_len + len) {
+    untokenize(p);
+  }
+  if ((size_t) vm->code_len + len > vm->lim.code) {
+    return vm_err(vm, "code OOM");
+  }
+  if (ptr != NULL) {
+    memmove(&vm->code[vm->code_len], ptr, len);
+  } else {
+    memset(&vm->code[vm->code_len], 0, len);
+  }
+  vm->code_len = (ind_t)(vm->code_len + len);
+  return JS_TRUE;
+}
 
-static jstok_t findtok(const jstok_t *toks, jstok_t tok) {
-  int i = 0;
-  while (tok != toks[i] && toks[i] != TOK_EOF) i++;
-  return toks[i];
+static jsval_t emit_byte(struct parser *p, int c) {
+  uint8_t byte = (uint8_t) c;
+  return emit(p, &byte, 1);
 }
 
-static float do_arith_op(float f1, float f2, jsval_t op) {
-  // clang-format off
-  switch (op) {
-    case '+': return f1 + f2;
-    case '-': return f1 - f2;
-    case '*': return f1 * f2;
-    case '/': return f1 / f2;
-    case '%': return (float) ((long) f1 % (long) f2);
-    case '^': return (float) ((jsval_t) f1 ^ (jsval_t) f2);
-    case '|': return (float) ((jsval_t) f1 | (jsval_t) f2);
-    case '&': return (float) ((jsval_t) f1 & (jsval_t) f2);
-    case DT('>','>'): return (float) ((long) f1 >> (long) f2);
-    case DT('<','<'): return (float) ((long) f1 << (long) f2);
-    case TT('>','>', '>'): return (float) ((jsval_t) f1 >> (jsval_t) f2);
-  }
-  // clang-format on
-  return 0;
+static jsval_t emit_val(struct parser *p, int op, jsval_t v) {
+  uint8_t buf[1 + sizeof(jsval_t)];
+  buf[0] = (uint8_t) op;
+  memcpy(buf + 1, &v, sizeof(v));
+  return emit(p, buf, sizeof(buf));
 }
 
-static jsval_t do_assign_op(struct elk *vm, jstok_t op) {
-  jsval_t *t = vm_top(vm);
-  struct prop *prop = &vm->props[(ind_t) tof(t[-1])];
-  if (js_type(prop->val) != JS_TYPE_NUMBER || js_type(t[0]) != JS_TYPE_NUMBER)
-    return vm_err(vm, "please no");
-  t[-1] = prop->val = tov(do_arith_op(tof(prop->val), tof(t[0]), op));
-  vm_drop(vm);
-  return prop->val;
+// Emit a length-prefixed name
+static jsval_t emit_str(struct parser *p, const char *ptr, jstok_t len) {
+  jsval_t res = JS_TRUE;
+  if (len > 0xff) return vm_err(p->vm, "string is too long");
+  TRY(emit_byte(p, (int) len));
+  return emit(p, ptr, (int) len);
 }
 
-static jsval_t do_op(struct parser *p, int op) {
-  jsval_t *top = vm_top(p->vm), a = top[-1], b = top[0];
-  if (p->noexec) return JS_TRUE;
-  DEBUG(("%s: sp %d op %c %d\n", __func__, p->vm->sp, op, op));
-  DEBUG(("    top-1 %s\n", tostr(p->vm, b)));
-  DEBUG(("    top-2 %s\n", tostr(p->vm, a)));
-  switch (op) {
-    case '+':
-      if (js_type(a) == JS_TYPE_STRING && js_type(b) == JS_TYPE_STRING) {
-        jsval_t v = js_concat(p->vm, a, b);
-        if (v == JS_ERROR) return v;
-        vm_drop(p->vm);
-        vm_drop(p->vm);
-        vm_push(p->vm, v);
-        break;
-      }
-    // clang-format off
-    case '-': case '*': case '/': case '%': case '^': case '&': case '|':
-    case DT('>', '>'): case DT('<', '<'): case TT('>', '>', '>'):
-      // clang-format on
-      if (js_type(a) == JS_TYPE_NUMBER && js_type(b) == JS_TYPE_NUMBER) {
-        jsval_t v = tov(do_arith_op(tof(a), tof(b), op));
-        vm_drop(p->vm);
-        vm_drop(p->vm);
-        vm_push(p->vm, v);
-      } else {
-        return vm_err(p->vm, "apples to apples please");
-      }
-      break;
-    /* clang-format off */
-    case DT('-', '='):      return do_assign_op(p->vm, '-');
-    case DT('+', '='):      return do_assign_op(p->vm, '+');
-    case DT('*', '='):      return do_assign_op(p->vm, '*');
-    case DT('/', '='):      return do_assign_op(p->vm, '/');
-    case DT('%', '='):      return do_assign_op(p->vm, '%');
-    case DT('&', '='):      return do_assign_op(p->vm, '&');
-    case DT('|', '='):      return do_assign_op(p->vm, '|');
-    case DT('^', '='):      return do_assign_op(p->vm, '^');
-    case TT('<', '<', '='): return do_assign_op(p->vm, DT('<', '<'));
-    case TT('>', '>', '='): return do_assign_op(p->vm, DT('>', '>'));
-    case QT('>', '>', '>', '='):  return do_assign_op(p->vm, TT('>', '>', '>'));
-    case ',': break;
-    /* clang-format on */
-    case TOK_POSTFIX_MINUS:
-    case TOK_POSTFIX_PLUS: {
-      struct prop *prop = &p->vm->props[(ind_t) tof(b)];
-      if (js_type(prop->val) != JS_TYPE_NUMBER)
-        return vm_err(p->vm, "please no");
-      top[0] = prop->val;
-      prop->val = tov(tof(prop->val) + ((op == TOK_POSTFIX_PLUS) ? 1 : -1));
-      break;
-    }
-    case '!':
-      top[0] = is_true(p->vm, top[0]) ? JS_FALSE : JS_TRUE;
-      break;
-    case '~':
-      if (js_type(top[0]) != JS_TYPE_NUMBER) return vm_err(p->vm, "noo");
-      top[0] = tov((float) (~(long) tof(top[0])));
-      break;
-    case TOK_UNARY_PLUS:
-      break;
-    case TOK_UNARY_MINUS:
-      top[0] = tov(-tof(top[0]));
-      break;
-      // static jstok_t s_unary_ops[] = {'!',        '~', DT('+', '+'), DT('-',
-      // '-'),
-      //                              TOK_TYPEOF, '-', '+',          TOK_EOF};
-    case TOK_TYPEOF:
-      top[0] = mk_str(p->vm, js_typeof(top[0]), -1);
-      break;
-#if 0
-    case '=': {
-      jsval_t obj = p->vm->call_stack[p->vm->csp - 1];
-      jsval_t res = js_set(p->vm, obj, a, b);
-      top[0] = a;
-      top[-1] = b;
-      if (res == JS_ERROR) return res;
-      return vm_drop(p->vm);
-    }
-#endif
-    default:
-      return vm_err(p->vm, "Unknown op: %c (%d)", op, op);
+// Emit an empty inline cache
+static jsval_t emit_ic(struct parser *p, int size) {
+  jsval_t res = JS_TRUE;
+  TRY(emit(p, NULL, size));
+  memset(&p->vm->code[p->vm->code_len - size], 0xff, (size_t) size);
+  return res;
+}
+
+// Emit a jump with the target yet unknown, and return the operand offset
+static jsval_t emit_jmp(struct parser *p, int op, ind_t *pos) {
+  jsval_t res = JS_TRUE;
+  TRY(emit_byte(p, op));
+  *pos = p->vm->code_len;
+  return emit(p, NULL, IND_SIZE);
+}
+
+// Point a jump emitted by emit_jmp() to the current code offset
+static void patch_jmp(struct parser *p, ind_t pos) {
+  put_ind(&p->vm->code[pos], p->vm->code_len);
+}
+
+static jsval_t emit_op(struct parser *p, jstok_t op) {
+  uint8_t buf[5];
+  buf[0] = OP_OP;
+  put32(buf + 1, op);
+  return emit(p, buf, sizeof(buf));
+}
+
+// Assignments, increments and decrements work on a reference to a variable
+// or an element, rather than on its value. Turn the just emitted OP_GET into
+// OP_REF, OP_SLOT into OP_SLOTREF, or OP_INDEX into OP_INDEXREF
+static jsval_t emit_ref(struct parser *p) {
+  struct elk *vm = p->vm;
+  if (p->ref != INVALID_INDEX && vm->code[p->ref] == OP_INDEX &&
+      p->ref + 1 == vm->code_len) {
+    vm->code[p->ref] = OP_INDEXREF;
+  } else if (p->ref != INVALID_INDEX && vm->code[p->ref] == OP_SLOT &&
+      p->ref + 2 == vm->code_len) {
+    vm->code[p->ref] = OP_SLOTREF;
+  } else if (p->ref != INVALID_INDEX && vm->code[p->ref] == OP_GET &&
+             p->ref + 2 + vm->code[p->ref + 1] + IC_GET_SIZE == vm->code_len) {
+    vm->code[p->ref] = OP_REF;
+  } else {
+    return vm_err(vm, "bad assignment target");
   }
   return JS_TRUE;
 }
 
-typedef jsval_t bpf_t(struct parser *p, int prev_op);
+// Frame slot of a parameter of the function being compiled, or -1
+static int param_slot(struct parser *p, const char *ptr, int len) {
+  const uint8_t *code = p->vm->code;
+  ind_t pc = (ind_t)(p->fn + FN_PARAMS);
+  int i;
+  if (p->fn == INVALID_INDEX) return -1;
+  for (i = 0; i < p->nparams; i++) {
+    if (code[pc] == len && memcmp(&code[pc + 1], ptr, (size_t) len) == 0) {
+      return i;
+    }
+    pc = (ind_t)(pc + 1 + code[pc]);
+  }
+  return -1;
+}
 
-static jsval_t parse_ltr_binop(struct parser *p, bpf_t f1, bpf_t f2,
-                               const jstok_t *ops, jstok_t prev_op) {
-  jsval_t res = JS_TRUE;
-  TRY(f1(p, TOK_EOF));
-  if (prev_op != TOK_EOF) TRY(do_op(p, prev_op));
-  if (findtok(ops, p->tok.tok) != TOK_EOF) {
-    int op = p->tok.tok;
-    pnext(p);
-    TRY(f2(p, op));
+// Binding power of binary operators: the higher, the tighter the operator
+// binds. Return 0 if a token is not a binary operator
+static int binop_bp(jstok_t tok) {
+  // clang-format off
+  switch (tok) {
+    case '*': case '/': case '%':                                 return 10;
+    case '+': case '-':                                           return 9;
+    case DT('<', '<'): case DT('>', '>'): case TT('>', '>', '>'): return 8;
+    case '<': case '>': case DT('<', '='): case DT('>', '='):     return 7;
+    case TT('=', '=', '='): case TT('!', '=', '='):               return 6;
+    case '&':                                                     return 5;
+    case '^':                                                     return 4;
+    case '|':                                                     return 3;
+    case DT('&', '&'):                                            return 2;
+    case DT('|', '|'):                                            return 1;
   }
-  return res;
+  // clang-format on
+  return 0;
 }
 
-static jsval_t parse_rtl_binop(struct parser *p, bpf_t f1, bpf_t f2,
-                               const jstok_t *ops, jstok_t prev_op) {
-  jsval_t res = JS_TRUE;
-  (void) prev_op;
-  TRY(f1(p, TOK_EOF));
-  if (findtok(ops, p->tok.tok) != TOK_EOF) {
-    int op = p->tok.tok;
-    pnext(p);
-    TRY(f2(p, TOK_EOF));
-    TRY(do_op(p, op));
+static int is_assign_op(jstok_t tok) {
+  // clang-format off
+  switch (tok) {
+    case '=': case DT('+', '='): case DT('-', '='): case DT('*', '='):
+    case DT('/', '='): case DT('%', '='): case TT('<', '<', '='):
+    case TT('>', '>', '='): case QT('>', '>', '>', '='): case DT('&', '='):
+    case DT('^', '='): case DT('|', '='):
+      return 1;
   }
-  return res;
+  // clang-format on
+  return 0;
 }
 
+// Peek at the next token. Pre-lexed tokens are just read from the array.
+// Otherwise, the token is lexed once and buffered for the next pnext()
 static jstok_t lookahead(struct parser *p) {
-  struct parser tmp = *p;
-  jstok_t tok = pnext(p);
-  *p = tmp;
-  return tok;
+  if (p->toks != NULL) return p->toks[p->ntoks - 1 - p->tok_idx].tok;
+  if (!p->has_peek) {
+    struct tok cur = p->tok;
+    jstok_t prev = p->prev_tok;
+    lex(p);
+    p->peek = p->tok;
+    p->tok = cur;
+    p->prev_tok = prev;
+    p->has_peek = true;
+  }
+  return p->peek.tok;
 }
 
 static jsval_t parse_block(struct parser *p, int mkscope) {
   jsval_t res = JS_TRUE;
-  if (mkscope && !p->noexec) TRY(create_scope(p->vm));
+  EXPECT(p, '{');
+  if (mkscope) TRY(emit_byte(p, OP_ENTER));
   TRY(parse_statement_list(p, '}'));
   EXPECT(p, '}');
-  if (mkscope && !p->noexec) TRY(delete_scope(p->vm));
+  if (mkscope) TRY(emit_byte(p, OP_LEAVE));
   return res;
 }
 
 static jsval_t parse_function(struct parser *p) {
   jsval_t res = JS_TRUE;
-  int name_provided = 0;
-  struct tok tmp = p->tok;
-  DEBUG(("%s: START: [%d]\n", __func__, p->vm->sp));
-  p->noexec++;
+  struct elk *vm = p->vm;
+  const char *src = p->tok.ptr;  // Source starts with the `function` keyword
+  int nparams = 0, outer_nparams = p->nparams;
+  ind_t h, src_len, outer_fn = p->fn;
+  uint32_t mask = 0;
+  bool outer_shadowed = p->shadowed;
+  DEBUG(("%s: START: [%d]\n", __func__, vm->code_len));
+  TRY(emit_byte(p, OP_FUNC));
+  h = vm->code_len;
+  TRY(emit(p, NULL, FN_PARAMS));  // Header is filled when the body is done
   pnext(p);
-  if (p->tok.tok == TOK_IDENT) {  // Function name provided: function ABC()...
-    name_provided = 1;
-    pnext(p);
-  }
+  if (p->tok.tok == TOK_IDENT) pnext(p);  // Function name: function ABC()...
   EXPECT(p, '(');
   pnext(p);
   // Emit names of function arguments
   while (p->tok.tok != ')') {
     EXPECT(p, TOK_IDENT);
+    TRY(emit_str(p, p->tok.ptr, p->tok.len));
+    mask |= (uint32_t) 1 << name_bit(p->tok.ptr, p->tok.len);
+    if (++nparams > 0xff) return vm_err(vm, "too many params");
     if (lookahead(p) == ',') pnext(p);
     pnext(p);
   }
   EXPECT(p, ')');
   pnext(p);
+  p->fn = h;  // Parameters of this function resolve to frame slots
+  p->nparams = nparams;
+  p->shadowed = false;
   TRY(parse_block(p, 0));
-  if (name_provided) TRY(do_op(p, '='));
-  {
-    jsval_t f = mk_func(p->vm, tmp.ptr, (int) (p->tok.ptr - tmp.ptr + 1));
-    TRY(f);
-    res = vm_push(p->vm, f);
-  }
-  p->noexec--;
-  DEBUG(("%s: STOP: [%d]\n", __func__, p->vm->sp));
+  TRY(emit_byte(p, OP_RET));
+  p->fn = outer_fn;
+  p->nparams = outer_nparams;
+  p->shadowed = outer_shadowed;
+  src_len = (ind_t)(p->tok.ptr - src + 1);
+  put_ind(&vm->code[h + FN_SRC], vm->code_len);
+  TRY(emit(p, src, src_len));
+  put_ind(&vm->code[h + FN_SRC_LEN], src_len);
+  put_ind(&vm->code[h + FN_END], vm->code_len);
+  vm->code[h + FN_NPARAMS] = (uint8_t) nparams;
+  put32(&vm->code[h + FN_MASK], mask);
+  DEBUG(("%s: STOP: [%d]\n", __func__, vm->code_len));
   return res;
 }
 
 static jsval_t parse_object_literal(struct parser *p) {
-  jsval_t obj = JS_UNDEFINED, key, val, res = JS_TRUE;
+  jsval_t res = JS_TRUE;
   pnext(p);
-  if (!p->noexec) {
-    TRY(mk_obj(p->vm));
-    obj = res;
-    TRY(vm_push(p->vm, obj));
-  }
+  TRY(emit_byte(p, OP_OBJ));
   while (p->tok.tok != '}') {
+    struct tok key = p->tok;
     if (p->tok.tok != TOK_IDENT && p->tok.tok != TOK_STR)
       return vm_err(p->vm, "error parsing obj key");
-    key = mk_str(p->vm, p->tok.ptr, p->tok.len);
-    TRY(key);
     pnext(p);
     EXPECT(p, ':');
     pnext(p);
     TRY(parse_expr(p));
-    if (!p->noexec) {
-      val = *vm_top(p->vm);
-      TRY(js_set(p->vm, obj, key, val));
-      vm_drop(p->vm);
-    }
+    TRY(emit_byte(p, OP_SETKEY));
+    TRY(emit_str(p, key.ptr, key.len));
     if (p->tok.tok == ',') {
       pnext(p);
     } else if (p->tok.tok != '}') {
       return vm_err(p->vm, "parsing obj: expecting '}'");
     }
   }
-  // printf("mko %s\n", tostr(p->vm, obj));
   return res;
 }
 
-static jsval_t parse_literal(struct parser *p, jstok_t prev_op) {
+static jsval_t parse_array_literal(struct parser *p) {
   jsval_t res = JS_TRUE;
-  (void) prev_op;
-  switch (p->tok.tok) {
-    case TOK_NUM:
-      if (!p->noexec) TRY(vm_push(p->vm, tov(p->tok.num_value)));
-      break;
-    case TOK_STR:
-      if (!p->noexec) {
-        jsval_t v = mk_str(p->vm, p->tok.ptr, p->tok.len);
-        TRY(v);
-        TRY(vm_push(p->vm, v));
+  pnext(p);
+  TRY(emit_byte(p, OP_ARR));
+  while (p->tok.tok != ']') {
+    TRY(parse_expr(p));
+    TRY(emit_byte(p, OP_APPEND));
+    if (p->tok.tok == ',') {
+      pnext(p);
+    } else if (p->tok.tok != ']') {
+      return vm_err(p->vm, "parsing array: expecting ']'");
+    }
+  }
+  return res;
+}
+
+static jsval_t parse_literal(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  switch (p->tok.tok) {
+    case TOK_NUM:
+      res = emit_val(p, OP_PUSH, tov(p->tok.num_value));
+      break;
+    case TOK_STR:
+      if (p->tok.len < 0xff) {
+        TRY(emit_byte(p, OP_STR));
+        res = emit_str(p, p->tok.ptr, p->tok.len);
+      } else {
+        uint8_t buf[1 + sizeof(ind_t)];
+        buf[0] = OP_LSTR;
+        put_ind(buf + 1, (ind_t) p->tok.len);
+        TRY(emit(p, buf, sizeof(buf)));
+        res = emit(p, p->tok.ptr, (int) p->tok.len);
       }
       break;
     case '{':
       res = parse_object_literal(p);
       break;
-    case TOK_IDENT:
-      // DEBUG(( "%s: IDENT: [%d]\n", __func__, prev_op));
-      if (!p->noexec) {
-        jstok_t prev_tok = p->prev_tok;
-        jstok_t next_tok = lookahead(p);
-        if (!findtok(s_assign_ops, next_tok) &&
-            !findtok(s_postfix_ops, next_tok) &&
-            !findtok(s_postfix_ops, prev_tok)) {
-          // Get value
-          res = lookup_and_push(p->vm, p->tok.ptr, p->tok.len);
-        } else {
-          // Assign
-          jsval_t *v = lookup(p->vm, p->tok.ptr, p->tok.len);
-          DEBUG(("%s: AS: [%.*s]\n", __func__, p->tok.len, p->tok.ptr));
-          if (v == NULL) {
-            return vm_err(p->vm, "doh");
-          } else {
-            // Push the index of a property that holds this key
-            size_t off = offsetof(struct prop, val);
-            struct prop *prop = (struct prop *) ((char *) v - off);
-            ind_t ind = (ind_t)(prop - p->vm->props);
-            DEBUG(("   ind %d\n", ind));
-            TRY(vm_push(p->vm, tov(ind)));
-          }
-        }
+    case '[':
+      res = parse_array_literal(p);
+      break;
+    case TOK_IDENT: {
+      int slot = p->shadowed ? -1 : param_slot(p, p->tok.ptr, p->tok.len);
+      p->ref = p->vm->code_len;  // Becomes a reference if it is assigned to
+      if (slot >= 0) {
+        TRY(emit_byte(p, OP_SLOT));
+        res = emit_byte(p, slot);
+        break;
       }
+      TRY(emit_byte(p, OP_GET));
+      TRY(emit_str(p, p->tok.ptr, p->tok.len));
+      res = emit_ic(p, IC_GET_SIZE);
       break;
+    }
     case TOK_FUNCTION:
       res = parse_function(p);
       break;
     case TOK_TRUE:
-      res = vm_push(p->vm, JS_TRUE);
+      res = emit_val(p, OP_PUSH, JS_TRUE);
       break;
     case TOK_FALSE:
-      res = vm_push(p->vm, JS_FALSE);
+      res = emit_val(p, OP_PUSH, JS_FALSE);
       break;
     case TOK_NULL:
-      res = vm_push(p->vm, JS_NULL);
+      res = emit_val(p, OP_PUSH, JS_NULL);
       break;
     case TOK_UNDEFINED:
-      res = vm_push(p->vm, JS_UNDEFINED);
+      res = emit_val(p, OP_PUSH, JS_UNDEFINED);
       break;
     case '(':
       pnext(p);
-      res = parse_expr(p);
+      TRY(parse_expr(p));
       EXPECT(p, ')');
       break;
     default:
@@ -1151,111 +2427,632 @@ static jsval_t parse_literal(struct parser *p, jstok_t prev_op) {
   return res;
 }
 
-static void setarg(struct parser *p, jsval_t scope, jsval_t val) {
-  jsval_t key = mk_str(p->vm, p->tok.ptr, p->tok.len);
-  if (js_type(key) == JS_TYPE_STRING) js_set(p->vm, scope, key, val);
-  // printf("  setarg: key %s\n", tostr(p->vm, key));
-  // printf("  setarg: val %s\n", tostr(p->vm, val));
-  // printf("  setarg scope: %s\n", tostr(p->vm, scope));
-  if (lookahead(p) == ',') pnext(p);
-  pnext(p);
+// Literal, followed by calls, member accesses and a postfix ++ or --
+static jsval_t parse_postfix(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  TRY(parse_literal(p));
+  while (p->tok.tok == '.' || p->tok.tok == '(' || p->tok.tok == '[') {
+    if (p->tok.tok == '[') {
+      pnext(p);
+      TRY(parse_expr(p));
+      EXPECT(p, ']');
+      p->ref = p->vm->code_len;  // Becomes a reference if it is assigned to
+      TRY(emit_byte(p, OP_INDEX));
+    } else if (p->tok.tok == '(') {
+      int argc = 0;
+      pnext(p);
+      while (p->tok.tok != ')') {
+        TRY(parse_expr(p));
+        if (p->tok.tok == ',') pnext(p);
+        if (++argc > 0xff) return vm_err(p->vm, "too many args");
+      }
+      TRY(emit_byte(p, OP_CALL));
+      TRY(emit_byte(p, argc));
+    } else {
+      pnext(p);
+      EXPECT(p, TOK_IDENT);
+      TRY(emit_byte(p, OP_DOT));
+      TRY(emit_str(p, p->tok.ptr, p->tok.len));
+      TRY(emit_ic(p, IC_DOT_SIZE));
+    }
+    pnext(p);
+  }
+  if (p->tok.tok == DT('+', '+') || p->tok.tok == DT('-', '-')) {
+    int op = p->tok.tok == DT('+', '+') ? TOK_POSTFIX_PLUS : TOK_POSTFIX_MINUS;
+    TRY(emit_ref(p));
+    TRY(emit_op(p, op));
+    pnext(p);
+  }
+  return res;
 }
 
-static jsval_t call_js_function(struct parser *p, jsval_t f) {
+static jsval_t parse_unary(struct parser *p) {
   jsval_t res = JS_TRUE;
-  ind_t saved_scp = p->vm->csp;
-  jsval_t scope;  // Function to call
+  jstok_t op = p->tok.tok;
+  // clang-format off
+  switch (op) {
+    case '!': case '~': case '-': case '+': case TOK_TYPEOF:
+    case DT('+', '+'): case DT('-', '-'):
+      pnext(p);
+      TRY(parse_unary(p));
+      if (op == '-') op = TOK_UNARY_MINUS;
+      if (op == '+') op = TOK_UNARY_PLUS;
+      if (op == DT('+', '+') || op == DT('-', '-')) TRY(emit_ref(p));
+      return emit_op(p, op);
+  }
+  // clang-format on
+  return parse_postfix(p);
+}
 
-  // Create parser for the function code
-  jslen_t code_len;
-  char *code = js_to_str(p->vm, f, &code_len);
-  struct parser p2 = mk_parser(p->vm, code, code_len);
+// Precedence climbing: parse operators that bind tighter than `minbp`.
+// Operators of equal power are left-associative. The right operand of
+// && and || is skipped by a jump if the left one decides the result
+static jsval_t parse_binary(struct parser *p, int minbp) {
+  jsval_t res = JS_TRUE;
+  int bp;
+  TRY(parse_unary(p));
+  while ((bp = binop_bp(p->tok.tok)) > minbp) {
+    jstok_t op = p->tok.tok;
+    pnext(p);
+    if (op == DT('&', '&') || op == DT('|', '|')) {
+      ind_t done;
+      TRY(emit_jmp(p, op == DT('&', '&') ? OP_JZ_KEEP : OP_JNZ_KEEP, &done));
+      TRY(parse_binary(p, bp));
+      patch_jmp(p, done);
+      p->ref = INVALID_INDEX;  // Result cannot be assigned to
+    } else {
+      TRY(parse_binary(p, bp));
+      TRY(emit_op(p, op));
+    }
+  }
+  return res;
+}
 
-  // Create scope
-  TRY(create_scope(p->vm));
-  scope = p->vm->call_stack[p->vm->csp - 1];
-  DEBUG(("%s: [%.*s]\n", __func__, code_len, code));
+static jsval_t parse_ternary(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  TRY(parse_binary(p, 0));
+  if (p->tok.tok == '?') {
+    ind_t if_false, done;
+    pnext(p);
+    TRY(emit_jmp(p, OP_JZ, &if_false));
+    TRY(parse_ternary(p));
+    EXPECT(p, ':');
+    pnext(p);
+    TRY(emit_jmp(p, OP_JMP, &done));
+    patch_jmp(p, if_false);
+    TRY(parse_ternary(p));
+    patch_jmp(p, done);
+    p->ref = INVALID_INDEX;  // Ternary result cannot be assigned to
+  }
+  return res;
+}
 
-  // Skip `function(` in the function definition
-  pnext(&p2);
-  pnext(&p2);
-  pnext(&p2);  // Now p2.tok points either to the first argument, or to the ')'
+// Assignments are right-associative
+static jsval_t parse_expr(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  TRY(parse_ternary(p));
+  if (is_assign_op(p->tok.tok)) {
+    jstok_t op = p->tok.tok;
+    TRY(emit_ref(p));
+    pnext(p);
+    TRY(parse_expr(p));
+    TRY(emit_op(p, op));
+  }
+  return res;
+}
 
-  // Parse parameters, populate the scope as local variables
-  while (p->tok.tok != ')') {
-    // Evaluate next argument - pushed to the data_stack
+static jsval_t parse_let(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  pnext(p);
+  for (;;) {
+    struct tok tmp = p->tok;
+    if (p->tok.tok != TOK_IDENT) return vm_err(p->vm, "indent expected");
+    if (param_slot(p, tmp.ptr, (int) tmp.len) >= 0) p->shadowed = true;
+    pnext(p);
+    if (p->tok.tok == '=') {
+      pnext(p);
+      TRY(parse_expr(p));
+    } else {
+      TRY(emit_val(p, OP_PUSH, JS_UNDEFINED));
+    }
+    TRY(emit_byte(p, OP_LET));
+    TRY(emit_str(p, tmp.ptr, tmp.len));
+    if (p->tok.tok == ',') {
+      TRY(emit_byte(p, OP_DROP));
+      pnext(p);
+    }
+    if (p->tok.tok == ';' || p->tok.tok == TOK_EOF) break;
+  }
+  return res;
+}
+
+static jsval_t parse_return(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  pnext(p);
+  // It is either "return;" or "return EXPR;"
+  if (p->tok.tok == ';' || p->tok.tok == '}' || p->tok.tok == TOK_EOF) {
+    TRY(emit_val(p, OP_PUSH, JS_UNDEFINED));
+  } else {
     TRY(parse_expr(p));
-    if (p->tok.tok == ',') pnext(p);
-    // Check whether we have a defined name for this argument
-    if (p2.tok.tok == TOK_IDENT) setarg(&p2, scope, *vm_top(p->vm));
-    vm_drop(p->vm);  // Drop argument value from the data_stack
-  }
-  // printf(" local scope: %s\n", tostr(p->vm, scope));
-  while (p2.tok.tok == TOK_IDENT) setarg(&p2, scope, JS_UNDEFINED);
-  while (p2.tok.tok != '{' && p2.tok.tok != TOK_EOF) pnext(&p2);
-  DEBUG(("%s: [%.*s] args %s\n", __func__, code_len, p2.tok.ptr,
-         tostr(p->vm, scope)));
-  res = parse_block(&p2, 0);             // Execute function body
-  DEBUG(("%s: [%.*s] res %s\n", __func__, (int) code_len, code,
-         tostr(p->vm, res)));
-  while (p->vm->csp > saved_scp) delete_scope(p->vm);  // Restore current scope
+  }
+  return emit_byte(p, OP_RET);
+}
+
+static jsval_t parse_while(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  ind_t cond = p->vm->code_len, done, loop;
+  pnext(p);
+  EXPECT(p, '(');
+  pnext(p);
+  TRY(parse_expr(p));
+  EXPECT(p, ')');
+  pnext(p);
+  // A false condition stays on stack, as the value of the whole loop
+  TRY(emit_jmp(p, OP_JZ_KEEP, &done));
+  TRY(parse_statement(p));
+  TRY(emit_byte(p, OP_DROP));
+  TRY(emit_jmp(p, OP_JMP, &loop));
+  put_ind(&p->vm->code[loop], cond);
+  patch_jmp(p, done);
   return res;
 }
 
-#define FFI_MAX_ARGS_CNT 6
-typedef intptr_t ffi_word_t;
+static jsval_t parse_if(struct parser *p) {
+  jsval_t res = JS_TRUE;
+  ind_t if_false, done;
+  pnext(p);
+  EXPECT(p, '(');
+  pnext(p);
+  TRY(parse_expr(p));
+  EXPECT(p, ')');
+  pnext(p);
+  TRY(emit_jmp(p, OP_JZ, &if_false));
+  TRY(parse_statement(p));
+  TRY(emit_jmp(p, OP_JMP, &done));
+  patch_jmp(p, if_false);
+  TRY(emit_val(p, OP_PUSH, JS_UNDEFINED));
+  patch_jmp(p, done);
+  return res;
+}
 
-enum ffi_ctype {
-  FFI_CTYPE_WORD,
-  FFI_CTYPE_BOOL,
-  FFI_CTYPE_FLOAT,
-  FFI_CTYPE_DOUBLE,
-};
+static jsval_t parse_statement(struct parser *p) {
+  switch (p->tok.tok) {
+    case ';':
+      pnext(p);
+      return emit_val(p, OP_PUSH, JS_UNDEFINED);
+    case TOK_LET:
+      return parse_let(p);
+    case '{': {
+      jsval_t res = parse_block(p, 1);
+      pnext(p);
+      return res;
+    }
+    case TOK_RETURN:
+      return parse_return(p);
+    case TOK_WHILE:
+      return parse_while(p);
+// clang-format off
+#if 0
+    case TOK_FOR: return parse_for(p);
+    case TOK_BREAK: pnext1(p); return JS_SUCCESS;
+    case TOK_CONTINUE: pnext1(p); return JS_SUCCESS;
+#endif
+    case TOK_IF: return parse_if(p);
+    case TOK_CASE: case TOK_CATCH: case TOK_DELETE: case TOK_DO:
+    case TOK_INSTANCEOF: case TOK_NEW: case TOK_SWITCH: case TOK_THROW:
+    case TOK_TRY: case TOK_VAR: case TOK_VOID: case TOK_WITH:
+      // clang-format on
+      return vm_err(p->vm, "[%.*s] not implemented", p->tok.len, p->tok.ptr);
+    default: {
+      jsval_t res = JS_TRUE;
+      for (;;) {
+        TRY(parse_expr(p));
+        if (p->tok.tok != ',') break;
+        TRY(emit_byte(p, OP_DROP));
+        pnext(p);
+      }
+      return res;
+    }
+  }
+}
 
-union ffi_val {
-  ffi_word_t w;
-  unsigned long i;
-  double d;
-  float f;
-};
+// Every statement leaves its value on stack. A statement list drops all
+// but the last one, so the list leaves exactly one value on stack.
+static jsval_t parse_statement_list(struct parser *p, jstok_t endtok) {
+  jsval_t res = JS_TRUE;
+  int has_value = 0;
+  pnext(p);
+  DEBUG(("%s: tok %c endtok %c\n", __func__, p->tok.tok, endtok));
+  while (p->tok.tok == ';') pnext(p);
+  while (res != JS_ERROR && p->tok.tok != TOK_EOF && p->tok.tok != endtok) {
+    if (has_value) TRY(emit_byte(p, OP_DROP));
+    res = parse_statement(p);
+    has_value = 1;
+    while (p->tok.tok == ';') pnext(p);
+  }
+  if (res != JS_ERROR && !has_value) res = emit_val(p, OP_PUSH, JS_UNDEFINED);
+  return res;
+}
 
-struct ffi_arg {
-  enum ffi_ctype ctype;
-  union ffi_val v;
-};
+//////////////////////////////// INTERPRETER ////////////////////////////////
+
+static jsval_t vm_exec(struct elk *vm, ind_t pc);
+
+#ifdef JS_NUM_INT32
+// Integer math. Results saturate, division truncates, x / 0 and x % 0 are 0
+static jsnum_t do_arith_op(jsnum_t a, jsnum_t b, jstok_t op) {
+  jsint_t r = 0;
+  // clang-format off
+  switch (op) {
+    case '+': r = (jsint_t) a + b; break;
+    case '-': r = (jsint_t) a - b; break;
+    case '*': r = (jsint_t) a * b; break;
+    case '/': if (b != 0) r = (jsint_t) a / b; break;
+    case '%': if (b != 0) r = (jsint_t) a % b; break;
+    case '^': r = a ^ b; break;
+    case '|': r = a | b; break;
+    case '&': r = a & b; break;
+    case DT('>','>'): r = a >> (b & 31); break;
+    case DT('<','<'): r = (int32_t) ((uint32_t) a << (b & 31)); break;
+    case TT('>','>', '>'): r = (uint32_t) a >> (b & 31); break;
+  }
+  // clang-format on
+  return (jsnum_t)(r < SMI_MIN ? SMI_MIN : r > SMI_MAX ? SMI_MAX : r);
+}
+
+static jsval_t do_num_op(jsval_t a, jsval_t b, jstok_t op) {
+  return MK_SMI(do_arith_op(tof(a), tof(b), op));
+}
+#else
+static jsnum_t do_arith_op(jsnum_t f1, jsnum_t f2, jstok_t op) {
+  int32_t a = toint32(f1), b = toint32(f2) & 31;
+  double q;
+  // clang-format off
+  switch (op) {
+    case '+': return f1 + f2;
+    case '-': return f1 - f2;
+    case '*': return f1 * f2;
+    case '/': return f1 / f2;
+    case '%': modf((double) f1 / f2, &q); return (jsnum_t) (f1 - f2 * q);
+    case '^': return (jsnum_t) (a ^ toint32(f2));
+    case '|': return (jsnum_t) (a | toint32(f2));
+    case '&': return (jsnum_t) (a & toint32(f2));
+    case DT('>','>'): return (jsnum_t) (a >> b);
+    case DT('<','<'): return (jsnum_t) (int32_t) ((uint32_t) a << b);
+    case TT('>','>', '>'): return (jsnum_t) ((uint32_t) a >> b);
+  }
+  // clang-format on
+  return 0;
+}
+
+// Integer arithmetic on two SMIs. Return JS_ERROR if the result is not
+// an SMI, like a fraction, an overflow or -0, and float math is needed
+static jsval_t do_smi_op(jsint_t a, jsint_t b, jstok_t op) {
+  jsint_t r;
+  // clang-format off
+  switch (op) {
+    case '+': r = a + b; break;
+    case '-': r = a - b; break;
+    case '*': {
+      int64_t m = (int64_t) a * b;
+      if (m < SMI_MIN || m > SMI_MAX || (m == 0 && (a < 0 || b < 0)))
+        return JS_ERROR;
+      r = (jsint_t) m;
+      break;
+    }
+    case '/':
+      if (b == 0 || a % b != 0 || (a == 0 && b < 0)) return JS_ERROR;
+      r = a / b;
+      break;
+    case '%':
+      if (b == 0 || (a < 0 && a % b == 0)) return JS_ERROR;
+      r = a % b;
+      break;
+    case '^': r = a ^ b; break;
+    case '|': r = a | b; break;
+    case '&': r = a & b; break;
+    case DT('>','>'): r = a >> (b & 31); break;
+    case DT('<','<'): r = (jsint_t) (int32_t) ((uint32_t) a << (b & 31)); break;
+    case TT('>','>','>'): {
+      uint32_t u = (uint32_t) a >> (b & 31);
+      if (u > SMI_MAX) return JS_ERROR;
+      r = (jsint_t) u;
+      break;
+    }
+    default: return JS_ERROR;
+  }
+  // clang-format on
+  return r < SMI_MIN || r > SMI_MAX ? JS_ERROR : MK_SMI(r);
+}
 
-#define IS_W(arg) ((arg).ctype == FFI_CTYPE_WORD)
-#define IS_D(arg) ((arg).ctype == FFI_CTYPE_DOUBLE)
-#define IS_F(arg) ((arg).ctype == FFI_CTYPE_FLOAT)
+static jsval_t do_num_op(jsval_t a, jsval_t b, jstok_t op) {
+  jsval_t v = JS_ERROR;
+  if (IS_SMI(a) && IS_SMI(b)) v = do_smi_op(SMI_VAL(a), SMI_VAL(b), op);
+  return v == JS_ERROR ? tov(do_arith_op(tof(a), tof(b), op)) : v;
+}
+#endif
+
+// Reference to a variable, pushed by OP_REF and OP_SLOTREF: an SMI that is
+// a property index, or a negated data stack index for frame slots
+static jsval_t mk_ref(struct elk *vm, jsval_t *v) {
+  size_t off = offsetof(struct prop, val);
+  if (v >= vm->data_stack && v < vm->data_stack + vm->lim.data_stack) {
+    return MK_SMI(-1 - (jsint_t)(v - vm->data_stack));
+  }
+  return MK_SMI((struct prop *) ((char *) v - off) - vm->props);
+}
+
+static jsval_t *deref(struct elk *vm, jsval_t ref) {
+  jsint_t i = SMI_VAL(ref);
+  return i < 0 ? &vm->data_stack[-1 - i] : &vm->props[i].val;
+}
+
+// Element of an array, string, pointer or buffer. Out of range is undefined
+static jsval_t get_elem(struct elk *vm, jsval_t obj, jsval_t idx) {
+  struct handle *h = tobuf(vm, obj);
+  jsint_t i = toi(idx);
+  if (js_type(idx) != JS_TYPE_NUMBER) {
+    return vm_err(vm, "pls index strings by num");
+  } else if (js_type(obj) == JS_TYPE_ARRAY) {
+    const jsval_t *a = arr_block(vm, obj);
+    return i >= 0 && i < (jsint_t) a[ARR_LEN] ? a[ARR_HDR + i] : JS_UNDEFINED;
+  } else if (h != NULL) {
+    if (i < 0 || i >= h->len) return JS_UNDEFINED;
+    return buf_get((uint8_t *) toptr(vm, obj) + i * s_bufsizes[h->type],
+                   h->type);
+  } else if (js_type(obj) == JS_TYPE_POINTER) {
+    return mk_int(((const uint8_t *) toptr(vm, obj))[i]);  // Byte at offset
+  } else if (js_type(obj) == JS_TYPE_STRING) {
+    jslen_t len;
+    const char *s = js_to_str(vm, obj, &len);
+    if (s == NULL) return JS_ERROR;
+    return i >= 0 && i < len ? mk_str(vm, s + i, 1) : JS_UNDEFINED;
+  }
+  return vm_err(vm, "pls index strings by num");
+}
+
+// Store an array element, or a number into a buffer element. Out of range
+// buffer stores are dropped
+static jsval_t set_elem(struct elk *vm, jsval_t obj, jsval_t idx, jsval_t v) {
+  struct handle *h = tobuf(vm, obj);
+  jsint_t i = toi(idx);
+  if (js_type(obj) == JS_TYPE_ARRAY && js_type(idx) == JS_TYPE_NUMBER) {
+    return arr_set(vm, obj, i, v);
+  } else if (h == NULL || js_type(idx) != JS_TYPE_NUMBER) {
+    return vm_err(vm, "bad assignment target");
+  } else if (js_type(v) != JS_TYPE_NUMBER) {
+    return vm_err(vm, "please no");
+  } else if (i >= 0 && i < h->len) {
+    buf_set((uint8_t *) toptr(vm, obj) + i * s_bufsizes[h->type], h->type, v);
+  }
+  return v;
+}
 
-#define W(arg) ((ffi_word_t)(arg).v.i)
-#define D(arg) ((arg).v.d)
-#define F(arg) ((arg).v.f)
+// An element reference, made by OP_INDEXREF, has the object and the index
+// right below it on the stack
+#define ELEM_REF MK_VAL(JS_TYPE_UNDEFINED, 1)
 
-static void ffi_set_word(struct ffi_arg *arg, ffi_word_t v) {
-  arg->ctype = FFI_CTYPE_WORD;
-  arg->v.i = v;
+static jsval_t ref_get(struct elk *vm, const jsval_t *ref) {
+  return *ref == ELEM_REF ? get_elem(vm, ref[-2], ref[-1]) : *deref(vm, *ref);
 }
 
-static void ffi_set_bool(struct ffi_arg *arg, bool v) {
-  arg->ctype = FFI_CTYPE_BOOL;
-  arg->v.i = v;
+static jsval_t ref_set(struct elk *vm, const jsval_t *ref, jsval_t v) {
+  if (*ref == ELEM_REF) return set_elem(vm, ref[-2], ref[-1], v);
+  return *deref(vm, *ref) = v;
 }
 
-static void ffi_set_ptr(struct ffi_arg *arg, void *v) {
-  ffi_set_word(arg, (ffi_word_t) v);
+// Replace a reference, and everything above it on the stack, with v
+static void ref_done(struct elk *vm, jsval_t *ref, jsval_t v) {
+  if (*ref == ELEM_REF) ref -= 2;
+  *ref = v;
+  vm->sp = (ind_t)(ref - vm->data_stack + 1);
 }
 
-static void ffi_set_double(struct ffi_arg *arg, double v) {
-  arg->ctype = FFI_CTYPE_DOUBLE;
-  arg->v.d = v;
+static jsval_t do_assign_op(struct elk *vm, jstok_t op) {
+  jsval_t *t = vm_top(vm), v = t[0];
+  if (op != '=') {
+    jsval_t old = ref_get(vm, &t[-1]);
+    if (old == JS_ERROR) return old;
+    if (op == '+' && js_type(old) == JS_TYPE_STRING &&
+        js_type(v) == JS_TYPE_STRING) {
+      if ((v = js_concat(vm, old, v)) == JS_ERROR) return v;
+    } else if (js_type(old) != JS_TYPE_NUMBER ||
+               js_type(v) != JS_TYPE_NUMBER) {
+      return vm_err(vm, "please no");
+    } else {
+      v = do_num_op(old, v, op);
+    }
+  }
+  if (ref_set(vm, &t[-1], v) == JS_ERROR) return JS_ERROR;
+  ref_done(vm, &t[-1], v);
+  return v;
 }
 
-static void ffi_set_float(struct ffi_arg *arg, float v) {
-  arg->ctype = FFI_CTYPE_FLOAT;
-  arg->v.f = v;
+// Compare two strings by bytes, like memcmp(). Ropes get flattened
+static jsval_t str_cmp(struct elk *vm, jsval_t a, jsval_t b, int *cmp) {
+  jslen_t n1, n2;
+  const char *p1 = js_to_str(vm, a, &n1), *p2 = js_to_str(vm, b, &n2);
+  if (p1 == NULL || p2 == NULL) return JS_ERROR;
+  *cmp = memcmp(p1, p2, n1 < n2 ? n1 : n2);
+  if (*cmp == 0) *cmp = n1 < n2 ? -1 : n1 > n2;
+  if (*cmp != 0) *cmp = *cmp < 0 ? -1 : 1;
+  return JS_TRUE;
 }
 
+// Strict equality, and relational operators on two numbers or two strings.
+// Numbers compare by value, so 0 === -0 and NaN !== NaN, strings by bytes.
+// Other values are equal only if they are the same value
+static jsval_t do_cmp_op(struct elk *vm, jsval_t a, jsval_t b, jstok_t op) {
+  int cmp = a == b ? 0 : 2;  // 2 means unordered, thus not equal
+  bool res;
+  if (js_type(a) == JS_TYPE_NUMBER && js_type(b) == JS_TYPE_NUMBER) {
+    jsnum_t x = tof(a), y = tof(b);
+    cmp = x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+  } else if (js_type(a) == JS_TYPE_STRING && js_type(b) == JS_TYPE_STRING) {
+    if (str_cmp(vm, a, b, &cmp) == JS_ERROR) return JS_ERROR;
+  } else if (op != TT('=', '=', '=') && op != TT('!', '=', '=')) {
+    return vm_err(vm, "apples to apples please");
+  }
+  // clang-format off
+  switch (op) {
+    case '<':               res = cmp == -1; break;
+    case '>':               res = cmp == 1; break;
+    case DT('<', '='):      res = cmp == -1 || cmp == 0; break;
+    case DT('>', '='):      res = cmp == 1 || cmp == 0; break;
+    case TT('!', '=', '='): res = cmp != 0; break;
+    default:                res = cmp == 0; break;
+  }
+  // clang-format on
+  return res ? JS_TRUE : JS_FALSE;
+}
+
+static jsval_t do_op(struct elk *vm, jstok_t op) {
+  jsval_t *top = vm_top(vm), a = top[-1], b = top[0];
+  DEBUG(("%s: sp %d op %c %d\n", __func__, vm->sp, op, op));
+  DEBUG(("    top-1 %s\n", tostr(vm, b)));
+  DEBUG(("    top-2 %s\n", tostr(vm, a)));
+  switch (op) {
+    case '+':
+      if (js_type(a) == JS_TYPE_STRING && js_type(b) == JS_TYPE_STRING) {
+        jsval_t v = js_concat(vm, a, b);
+        if (v == JS_ERROR) return v;
+        vm_drop(vm);
+        vm_drop(vm);
+        vm_push(vm, v);
+        break;
+      }
+      // fallthrough
+    // clang-format off
+    case '-': case '*': case '/': case '%': case '^': case '&': case '|':
+    case DT('>', '>'): case DT('<', '<'): case TT('>', '>', '>'):
+      // clang-format on
+      if (js_type(a) == JS_TYPE_NUMBER && js_type(b) == JS_TYPE_NUMBER) {
+        jsval_t v = do_num_op(a, b, op);
+        vm_drop(vm);
+        vm_drop(vm);
+        vm_push(vm, v);
+      } else {
+        return vm_err(vm, "apples to apples please");
+      }
+      break;
+    /* clang-format off */
+    case DT('-', '='):      return do_assign_op(vm, '-');
+    case DT('+', '='):      return do_assign_op(vm, '+');
+    case DT('*', '='):      return do_assign_op(vm, '*');
+    case DT('/', '='):      return do_assign_op(vm, '/');
+    case DT('%', '='):      return do_assign_op(vm, '%');
+    case DT('&', '='):      return do_assign_op(vm, '&');
+    case DT('|', '='):      return do_assign_op(vm, '|');
+    case DT('^', '='):      return do_assign_op(vm, '^');
+    case TT('<', '<', '='): return do_assign_op(vm, DT('<', '<'));
+    case TT('>', '>', '='): return do_assign_op(vm, DT('>', '>'));
+    case QT('>', '>', '>', '='):  return do_assign_op(vm, TT('>', '>', '>'));
+    case ',': break;
+    /* clang-format on */
+    case '<': case '>': case DT('<', '='): case DT('>', '='):
+    case TT('=', '=', '='): case TT('!', '=', '='): {
+      jsval_t v = do_cmp_op(vm, a, b, op);
+      if (v == JS_ERROR) return v;
+      vm_drop(vm);
+      vm_drop(vm);
+      vm_push(vm, v);
+      break;
+    }
+    // Prefix increment pushes the new value, postfix the old one
+    case DT('+', '+'):
+    case DT('-', '-'):
+    case TOK_POSTFIX_MINUS:
+    case TOK_POSTFIX_PLUS: {
+      jsval_t v = ref_get(vm, top), n;
+      int inc = op == DT('+', '+') || op == TOK_POSTFIX_PLUS ? 1 : -1;
+      if (v == JS_ERROR) return v;
+      if (js_type(v) != JS_TYPE_NUMBER) return vm_err(vm, "please no");
+      n = do_num_op(v, MK_SMI(inc), '+');
+      if (ref_set(vm, top, n) == JS_ERROR) return JS_ERROR;
+      ref_done(vm, top, op == DT('+', '+') || op == DT('-', '-') ? n : v);
+      break;
+    }
+    case '!':
+      top[0] = is_true(vm, top[0]) ? JS_FALSE : JS_TRUE;
+      break;
+    case '~':
+      if (js_type(top[0]) != JS_TYPE_NUMBER) return vm_err(vm, "noo");
+      top[0] = mk_int(~toi32(top[0]));
+      break;
+    case TOK_UNARY_PLUS:
+      break;
+    case TOK_UNARY_MINUS:
+#ifdef JS_NUM_INT32
+      top[0] = mk_int(-toi(top[0]));
+#else
+      if (IS_SMI(top[0]) && SMI_VAL(top[0]) > SMI_MIN && top[0] != MK_SMI(0)) {
+        top[0] = MK_SMI(-SMI_VAL(top[0]));
+      } else {
+        top[0] = tov(-tof(top[0]));
+      }
+#endif
+      break;
+    case TOK_TYPEOF: {
+      jsval_t v = mk_str(vm, js_typeof(top[0]), -1);
+      if (v == JS_ERROR) return v;
+      top[0] = v;
+      break;
+    }
+    case '=': return do_assign_op(vm, '=');
+    default:
+      return vm_err(vm, "Unknown op: %c (%d)", op, op);
+  }
+  return JS_TRUE;
+}
+
+// Call JS function. The function and its arguments are on stack, and get
+// replaced by the call result. Arguments become the slots of a new frame,
+// one per parameter: extra ones are dropped, missing ones are undefined
+static jsval_t call_js_function(struct elk *vm, jsval_t f, int argc) {
+  jsval_t res = JS_TRUE;
+  ind_t i, fp = (ind_t)(vm->sp - argc - 1), csp = vm->csp, prev_fp = vm->fp;
+  ind_t h = (ind_t) VAL_PAYLOAD(f), pc = (ind_t)(h + FN_PARAMS);
+  int nparams = vm->code[h + FN_NPARAMS];
+
+  for (; argc > nparams; argc--) vm_drop(vm);
+  for (; argc < nparams && res != JS_ERROR; argc++) {
+    res = vm_push(vm, JS_UNDEFINED);
+  }
+  if (res != JS_ERROR && vm->csp >= vm->lim.call_stack - 1) {
+    res = vm_err(vm, "Call stack OOM");
+  }
+  if (res != JS_ERROR) {
+    vm->call_stack[vm->csp++] = MK_SMI(fp + 1);
+    vm->fp = (ind_t)(fp + 1);
+    for (i = 0; (int) i < nparams; i++) pc = (ind_t)(pc + 1 + vm->code[pc]);
+    res = vm_exec(vm, pc);  // Execute function body
+  }
+  if (res != JS_ERROR) {
+    vm->data_stack[fp] = *vm_top(vm);  // Replace function with the result
+    vm->sp--;
+  }
+  vm->fp = prev_fp;
+  while (vm->csp > csp) delete_scope(vm);  // Restore current scope
+  while (vm->sp > fp + 1) vm_drop(vm);     // Abandon arguments
+  return res;
+}
+
+typedef intptr_t ffi_word_t;
+
+enum ffi_ctype {
+  FFI_CTYPE_WORD,
+  FFI_CTYPE_BOOL,
+  FFI_CTYPE_FLOAT,
+  FFI_CTYPE_DOUBLE,
+};
+
+union ffi_val {
+  ffi_word_t w;
+  unsigned long i;
+  double d;
+  float f;
+};
+
 // The ARM ABI uses only 4 32-bit registers for paramter passing.
 // Xtensa call0 calling-convention (as used by Espressif) has 6.
 // Focusing only on implementing FFI with registers means we can simplify a
@@ -1278,524 +3075,165 @@ static void ffi_set_float(struct ffi_arg *arg, float v) {
 //
 // I.e, the compiler generates exactly the same code for:
 // void foo(int a, double b) {...}  and void foo(double b, int a) {...}
+//
+// Every supported signature gets its own trampoline, which casts the
+// function pointer to the right type and makes the call. A trampoline is
+// picked once by ffi_prepare(), when the function is imported.
+
+#define W(n) ((ffi_word_t) a[n].i)
+#define D(n) (a[n].d)
+#define F(n) (a[n].f)
+#define WT ffi_word_t
+
+#define FFI_THUNK(name, rt, fld, params, args)                            \
+  static void ffi_##name(cfn_t fn, union ffi_val *r,                      \
+                         const union ffi_val *a) {                        \
+    r->fld = ((rt(*) params) fn) args;                                    \
+  }
 
-typedef ffi_word_t (*w4w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t);
-typedef ffi_word_t (*w5w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                            ffi_word_t);
-typedef ffi_word_t (*w6w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                            ffi_word_t, ffi_word_t);
-
-typedef ffi_word_t (*wdw_t)(double, ffi_word_t);
-typedef ffi_word_t (*wwd_t)(ffi_word_t, double);
-typedef ffi_word_t (*wdd_t)(double, double);
-
-typedef ffi_word_t (*wwwd_t)(ffi_word_t, ffi_word_t, double);
-typedef ffi_word_t (*wwdw_t)(ffi_word_t, double, ffi_word_t);
-typedef ffi_word_t (*wwdd_t)(ffi_word_t, double, double);
-typedef ffi_word_t (*wdww_t)(double, ffi_word_t, ffi_word_t);
-typedef ffi_word_t (*wdwd_t)(double, ffi_word_t, double);
-typedef ffi_word_t (*wddw_t)(double, double, ffi_word_t);
-typedef ffi_word_t (*wddd_t)(double, double, double);
-
-typedef ffi_word_t (*wfw_t)(float, ffi_word_t);
-typedef ffi_word_t (*wwf_t)(ffi_word_t, float);
-typedef ffi_word_t (*wff_t)(float, float);
-
-typedef ffi_word_t (*wwwf_t)(ffi_word_t, ffi_word_t, float);
-typedef ffi_word_t (*wwfw_t)(ffi_word_t, float, ffi_word_t);
-typedef ffi_word_t (*wwff_t)(ffi_word_t, float, float);
-typedef ffi_word_t (*wfww_t)(float, ffi_word_t, ffi_word_t);
-typedef ffi_word_t (*wfwf_t)(float, ffi_word_t, float);
-typedef ffi_word_t (*wffw_t)(float, float, ffi_word_t);
-typedef ffi_word_t (*wfff_t)(float, float, float);
-
-typedef bool (*b4w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t);
-typedef bool (*b5w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                      ffi_word_t);
-typedef bool (*b6w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                      ffi_word_t, ffi_word_t);
-typedef bool (*bdw_t)(double, ffi_word_t);
-typedef bool (*bwd_t)(ffi_word_t, double);
-typedef bool (*bdd_t)(double, double);
-
-typedef bool (*bwwd_t)(ffi_word_t, ffi_word_t, double);
-typedef bool (*bwdw_t)(ffi_word_t, double, ffi_word_t);
-typedef bool (*bwdd_t)(ffi_word_t, double, double);
-typedef bool (*bdww_t)(double, ffi_word_t, ffi_word_t);
-typedef bool (*bdwd_t)(double, ffi_word_t, double);
-typedef bool (*bddw_t)(double, double, ffi_word_t);
-typedef bool (*bddd_t)(double, double, double);
-
-typedef bool (*bfw_t)(float, ffi_word_t);
-typedef bool (*bwf_t)(ffi_word_t, float);
-typedef bool (*bff_t)(float, float);
-
-typedef bool (*bwwf_t)(ffi_word_t, ffi_word_t, float);
-typedef bool (*bwfw_t)(ffi_word_t, float, ffi_word_t);
-typedef bool (*bwff_t)(ffi_word_t, float, float);
-typedef bool (*bfww_t)(float, ffi_word_t, ffi_word_t);
-typedef bool (*bfwf_t)(float, ffi_word_t, float);
-typedef bool (*bffw_t)(float, float, ffi_word_t);
-typedef bool (*bfff_t)(float, float, float);
-
-typedef double (*d4w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t);
-typedef double (*d5w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                        ffi_word_t);
-typedef double (*d6w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                        ffi_word_t, ffi_word_t);
-typedef double (*ddw_t)(double, ffi_word_t);
-typedef double (*dwd_t)(ffi_word_t, double);
-typedef double (*ddd_t)(double, double);
-
-typedef double (*dwwd_t)(ffi_word_t, ffi_word_t, double);
-typedef double (*dwdw_t)(ffi_word_t, double, ffi_word_t);
-typedef double (*dwdd_t)(ffi_word_t, double, double);
-typedef double (*ddww_t)(double, ffi_word_t, ffi_word_t);
-typedef double (*ddwd_t)(double, ffi_word_t, double);
-typedef double (*dddw_t)(double, double, ffi_word_t);
-typedef double (*dddd_t)(double, double, double);
-
-typedef float (*f4w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t);
-typedef float (*f5w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                       ffi_word_t);
-typedef float (*f6w_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
-                       ffi_word_t, ffi_word_t);
-typedef float (*ffw_t)(float, ffi_word_t);
-typedef float (*fwf_t)(ffi_word_t, float);
-typedef float (*fff_t)(float, float);
-
-typedef float (*fwwf_t)(ffi_word_t, ffi_word_t, float);
-typedef float (*fwfw_t)(ffi_word_t, float, ffi_word_t);
-typedef float (*fwff_t)(ffi_word_t, float, float);
-typedef float (*ffww_t)(float, ffi_word_t, ffi_word_t);
-typedef float (*ffwf_t)(float, ffi_word_t, float);
-typedef float (*fffw_t)(float, float, ffi_word_t);
-typedef float (*ffff_t)(float, float, float);
-
-static int ffi_call(cfn_t func, int nargs, struct ffi_arg *res,
-                    struct ffi_arg *args) {
-  int i, doubles = 0, floats = 0;
-
-  if (nargs > 6) return -1;
-  for (i = 0; i < nargs; i++) {
-    doubles += (IS_D(args[i]));
-    floats += (IS_F(args[i]));
-  }
-
-  // Doubles and floats are not supported together atm
-  if (doubles > 0 && floats > 0) return -1;
-
-  switch (res->ctype) {
-    case FFI_CTYPE_WORD: {
-      ffi_word_t r;
-      if (doubles == 0) {
-        if (floats == 0) {
-          // No double and no float args: we currently support up to 6
-          // word-sized arguments
-          if (nargs <= 4) {
-            w4w_t f = (w4w_t) func;
-            r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]));
-          } else if (nargs == 5) {
-            w5w_t f = (w5w_t) func;
-            r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]));
-          } else if (nargs == 6) {
-            w6w_t f = (w6w_t) func;
-            r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]),
-                  W(args[5]));
-          } else {
-            abort();
-          }
-        } else {
-          // There are some floats
-          switch (nargs) {
-            case 0:
-            case 1:
-            case 2:
-              if (IS_F(args[0]) && IS_F(args[1])) {
-                wff_t f = (wff_t) func;
-                r = f(F(args[0]), F(args[1]));
-              } else if (IS_F(args[0])) {
-                wfw_t f = (wfw_t) func;
-                r = f(F(args[0]), W(args[1]));
-              } else {
-                wwf_t f = (wwf_t) func;
-                r = f(W(args[0]), F(args[1]));
-              }
-              break;
-
-            case 3:
-              if (IS_W(args[0]) && IS_W(args[1]) && IS_F(args[2])) {
-                wwwf_t f = (wwwf_t) func;
-                r = f(W(args[0]), W(args[1]), F(args[2]));
-              } else if (IS_W(args[0]) && IS_F(args[1]) && IS_W(args[2])) {
-                wwfw_t f = (wwfw_t) func;
-                r = f(W(args[0]), F(args[1]), W(args[2]));
-              } else if (IS_W(args[0]) && IS_F(args[1]) && IS_F(args[2])) {
-                wwff_t f = (wwff_t) func;
-                r = f(W(args[0]), F(args[1]), F(args[2]));
-              } else if (IS_F(args[0]) && IS_W(args[1]) && IS_W(args[2])) {
-                wfww_t f = (wfww_t) func;
-                r = f(F(args[0]), W(args[1]), W(args[2]));
-              } else if (IS_F(args[0]) && IS_W(args[1]) && IS_F(args[2])) {
-                wfwf_t f = (wfwf_t) func;
-                r = f(F(args[0]), W(args[1]), F(args[2]));
-              } else if (IS_F(args[0]) && IS_F(args[1]) && IS_W(args[2])) {
-                wffw_t f = (wffw_t) func;
-                r = f(F(args[0]), F(args[1]), W(args[2]));
-              } else if (IS_F(args[0]) && IS_F(args[1]) && IS_F(args[2])) {
-                wfff_t f = (wfff_t) func;
-                r = f(F(args[0]), F(args[1]), F(args[2]));
-              } else {
-                // The above checks should be exhaustive
-                abort();
-              }
-              break;
-            default:
-              return -1;
-          }
-        }
-      } else {
-        // There are some doubles
-        switch (nargs) {
-          case 0:
-          case 1:
-          case 2:
-            if (IS_D(args[0]) && IS_D(args[1])) {
-              wdd_t f = (wdd_t) func;
-              r = f(D(args[0]), D(args[1]));
-            } else if (IS_D(args[0])) {
-              wdw_t f = (wdw_t) func;
-              r = f(D(args[0]), W(args[1]));
-            } else {
-              wwd_t f = (wwd_t) func;
-              r = f(W(args[0]), D(args[1]));
-            }
-            break;
-
-          case 3:
-            if (IS_W(args[0]) && IS_W(args[1]) && IS_D(args[2])) {
-              wwwd_t f = (wwwd_t) func;
-              r = f(W(args[0]), W(args[1]), D(args[2]));
-            } else if (IS_W(args[0]) && IS_D(args[1]) && IS_W(args[2])) {
-              wwdw_t f = (wwdw_t) func;
-              r = f(W(args[0]), D(args[1]), W(args[2]));
-            } else if (IS_W(args[0]) && IS_D(args[1]) && IS_D(args[2])) {
-              wwdd_t f = (wwdd_t) func;
-              r = f(W(args[0]), D(args[1]), D(args[2]));
-            } else if (IS_D(args[0]) && IS_W(args[1]) && IS_W(args[2])) {
-              wdww_t f = (wdww_t) func;
-              r = f(D(args[0]), W(args[1]), W(args[2]));
-            } else if (IS_D(args[0]) && IS_W(args[1]) && IS_D(args[2])) {
-              wdwd_t f = (wdwd_t) func;
-              r = f(D(args[0]), W(args[1]), D(args[2]));
-            } else if (IS_D(args[0]) && IS_D(args[1]) && IS_W(args[2])) {
-              wddw_t f = (wddw_t) func;
-              r = f(D(args[0]), D(args[1]), W(args[2]));
-            } else if (IS_D(args[0]) && IS_D(args[1]) && IS_D(args[2])) {
-              wddd_t f = (wddd_t) func;
-              r = f(D(args[0]), D(args[1]), D(args[2]));
-            } else {
-              // The above checks should be exhaustive
-              abort();
-            }
-            break;
-          default:
-            return -1;
-        }
-      }
-      res->v.i = (ffi_word_t) r;
-    } break;
-    case FFI_CTYPE_BOOL: {
-      ffi_word_t r;
-      if (doubles == 0) {
-        if (floats == 0) {
-          // No double and no float args: we currently support up to 6
-          // word-sized arguments
-          if (nargs <= 4) {
-            b4w_t f = (b4w_t) func;
-            r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]));
-          } else if (nargs == 5) {
-            b5w_t f = (b5w_t) func;
-            r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]));
-          } else if (nargs == 6) {
-            b6w_t f = (b6w_t) func;
-            r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]),
-                  W(args[5]));
-          } else {
-            abort();
-          }
-        } else {
-          // There are some floats
-          switch (nargs) {
-            case 0:
-            case 1:
-            case 2:
-              if (IS_F(args[0]) && IS_F(args[1])) {
-                bff_t f = (bff_t) func;
-                r = f(F(args[0]), F(args[1]));
-              } else if (IS_F(args[0])) {
-                bfw_t f = (bfw_t) func;
-                r = f(F(args[0]), W(args[1]));
-              } else {
-                bwf_t f = (bwf_t) func;
-                r = f(W(args[0]), F(args[1]));
-              }
-              break;
-
-            case 3:
-              if (IS_W(args[0]) && IS_W(args[1]) && IS_F(args[2])) {
-                bwwf_t f = (bwwf_t) func;
-                r = f(W(args[0]), W(args[1]), F(args[2]));
-              } else if (IS_W(args[0]) && IS_F(args[1]) && IS_W(args[2])) {
-                bwfw_t f = (bwfw_t) func;
-                r = f(W(args[0]), F(args[1]), W(args[2]));
-              } else if (IS_W(args[0]) && IS_F(args[1]) && IS_F(args[2])) {
-                bwff_t f = (bwff_t) func;
-                r = f(W(args[0]), F(args[1]), F(args[2]));
-              } else if (IS_F(args[0]) && IS_W(args[1]) && IS_W(args[2])) {
-                bfww_t f = (bfww_t) func;
-                r = f(F(args[0]), W(args[1]), W(args[2]));
-              } else if (IS_F(args[0]) && IS_W(args[1]) && IS_F(args[2])) {
-                bfwf_t f = (bfwf_t) func;
-                r = f(F(args[0]), W(args[1]), F(args[2]));
-              } else if (IS_F(args[0]) && IS_F(args[1]) && IS_W(args[2])) {
-                bffw_t f = (bffw_t) func;
-                r = f(F(args[0]), F(args[1]), W(args[2]));
-              } else if (IS_F(args[0]) && IS_F(args[1]) && IS_F(args[2])) {
-                bfff_t f = (bfff_t) func;
-                r = f(F(args[0]), F(args[1]), F(args[2]));
-              } else {
-                // The above checks should be exhaustive
-                abort();
-              }
-              break;
-            default:
-              return -1;
-          }
-        }
-      } else {
-        // There are some doubles
-        switch (nargs) {
-          case 0:
-          case 1:
-          case 2:
-            if (IS_D(args[0]) && IS_D(args[1])) {
-              bdd_t f = (bdd_t) func;
-              r = f(D(args[0]), D(args[1]));
-            } else if (IS_D(args[0])) {
-              bdw_t f = (bdw_t) func;
-              r = f(D(args[0]), W(args[1]));
-            } else {
-              bwd_t f = (bwd_t) func;
-              r = f(W(args[0]), D(args[1]));
-            }
-            break;
-
-          case 3:
-            if (IS_W(args[0]) && IS_W(args[1]) && IS_D(args[2])) {
-              bwwd_t f = (bwwd_t) func;
-              r = f(W(args[0]), W(args[1]), D(args[2]));
-            } else if (IS_W(args[0]) && IS_D(args[1]) && IS_W(args[2])) {
-              bwdw_t f = (bwdw_t) func;
-              r = f(W(args[0]), D(args[1]), W(args[2]));
-            } else if (IS_W(args[0]) && IS_D(args[1]) && IS_D(args[2])) {
-              bwdd_t f = (bwdd_t) func;
-              r = f(W(args[0]), D(args[1]), D(args[2]));
-            } else if (IS_D(args[0]) && IS_W(args[1]) && IS_W(args[2])) {
-              bdww_t f = (bdww_t) func;
-              r = f(D(args[0]), W(args[1]), W(args[2]));
-            } else if (IS_D(args[0]) && IS_W(args[1]) && IS_D(args[2])) {
-              bdwd_t f = (bdwd_t) func;
-              r = f(D(args[0]), W(args[1]), D(args[2]));
-            } else if (IS_D(args[0]) && IS_D(args[1]) && IS_W(args[2])) {
-              bddw_t f = (bddw_t) func;
-              r = f(D(args[0]), D(args[1]), W(args[2]));
-            } else if (IS_D(args[0]) && IS_D(args[1]) && IS_D(args[2])) {
-              bddd_t f = (bddd_t) func;
-              r = f(D(args[0]), D(args[1]), D(args[2]));
-            } else {
-              // The above checks should be exhaustive
-              abort();
-            }
-            break;
-          default:
-            return -1;
-        }
-      }
-      res->v.i = (ffi_word_t) r;
-    } break;
-    case FFI_CTYPE_DOUBLE: {
-      double r;
-      if (doubles == 0) {
-        // No double args: we currently support up to 6 word-sized arguments
-        if (nargs <= 4) {
-          d4w_t f = (d4w_t) func;
-          r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]));
-        } else if (nargs == 5) {
-          d5w_t f = (d5w_t) func;
-          r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]));
-        } else if (nargs == 6) {
-          d6w_t f = (d6w_t) func;
-          r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]),
-                W(args[5]));
-        } else {
-          abort();
-        }
-      } else {
-        switch (nargs) {
-          case 0:
-          case 1:
-          case 2:
-            if (IS_D(args[0]) && IS_D(args[1])) {
-              ddd_t f = (ddd_t) func;
-              r = f(D(args[0]), D(args[1]));
-            } else if (IS_D(args[0])) {
-              ddw_t f = (ddw_t) func;
-              r = f(D(args[0]), W(args[1]));
-            } else {
-              dwd_t f = (dwd_t) func;
-              r = f(W(args[0]), D(args[1]));
-            }
-            break;
-
-          case 3:
-            if (IS_W(args[0]) && IS_W(args[1]) && IS_D(args[2])) {
-              dwwd_t f = (dwwd_t) func;
-              r = f(W(args[0]), W(args[1]), D(args[2]));
-            } else if (IS_W(args[0]) && IS_D(args[1]) && IS_W(args[2])) {
-              dwdw_t f = (dwdw_t) func;
-              r = f(W(args[0]), D(args[1]), W(args[2]));
-            } else if (IS_W(args[0]) && IS_D(args[1]) && IS_D(args[2])) {
-              dwdd_t f = (dwdd_t) func;
-              r = f(W(args[0]), D(args[1]), D(args[2]));
-            } else if (IS_D(args[0]) && IS_W(args[1]) && IS_W(args[2])) {
-              ddww_t f = (ddww_t) func;
-              r = f(D(args[0]), W(args[1]), W(args[2]));
-            } else if (IS_D(args[0]) && IS_W(args[1]) && IS_D(args[2])) {
-              ddwd_t f = (ddwd_t) func;
-              r = f(D(args[0]), W(args[1]), D(args[2]));
-            } else if (IS_D(args[0]) && IS_D(args[1]) && IS_W(args[2])) {
-              dddw_t f = (dddw_t) func;
-              r = f(D(args[0]), D(args[1]), W(args[2]));
-            } else if (IS_D(args[0]) && IS_D(args[1]) && IS_D(args[2])) {
-              dddd_t f = (dddd_t) func;
-              r = f(D(args[0]), D(args[1]), D(args[2]));
-            } else {
-              // The above checks should be exhaustive
-              abort();
-            }
-            break;
-          default:
-            return -1;
-        }
-      }
-      res->v.d = r;
-    } break;
-    case FFI_CTYPE_FLOAT: {
-      double r;
-      if (floats == 0) {
-        // No float args: we currently support up to 6 word-sized arguments
-        if (nargs <= 4) {
-          f4w_t f = (f4w_t) func;
-          r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]));
-        } else if (nargs == 5) {
-          f5w_t f = (f5w_t) func;
-          r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]));
-        } else if (nargs == 6) {
-          f6w_t f = (f6w_t) func;
-          r = f(W(args[0]), W(args[1]), W(args[2]), W(args[3]), W(args[4]),
-                W(args[5]));
-        } else {
-          abort();
-        }
-      } else {
-        // There are some floats
-        switch (nargs) {
-          case 0:
-          case 1:
-          case 2:
-            if (IS_F(args[0]) && IS_F(args[1])) {
-              fff_t f = (fff_t) func;
-              r = f(F(args[0]), F(args[1]));
-            } else if (IS_F(args[0])) {
-              ffw_t f = (ffw_t) func;
-              r = f(F(args[0]), W(args[1]));
-            } else {
-              fwf_t f = (fwf_t) func;
-              r = f(W(args[0]), F(args[1]));
-            }
-            break;
-
-          case 3:
-            if (IS_W(args[0]) && IS_W(args[1]) && IS_F(args[2])) {
-              fwwf_t f = (fwwf_t) func;
-              r = f(W(args[0]), W(args[1]), F(args[2]));
-            } else if (IS_W(args[0]) && IS_F(args[1]) && IS_W(args[2])) {
-              fwfw_t f = (fwfw_t) func;
-              r = f(W(args[0]), F(args[1]), W(args[2]));
-            } else if (IS_W(args[0]) && IS_F(args[1]) && IS_F(args[2])) {
-              fwff_t f = (fwff_t) func;
-              r = f(W(args[0]), F(args[1]), F(args[2]));
-            } else if (IS_F(args[0]) && IS_W(args[1]) && IS_W(args[2])) {
-              ffww_t f = (ffww_t) func;
-              r = f(F(args[0]), W(args[1]), W(args[2]));
-            } else if (IS_F(args[0]) && IS_W(args[1]) && IS_F(args[2])) {
-              ffwf_t f = (ffwf_t) func;
-              r = f(F(args[0]), W(args[1]), F(args[2]));
-            } else if (IS_F(args[0]) && IS_F(args[1]) && IS_W(args[2])) {
-              fffw_t f = (fffw_t) func;
-              r = f(F(args[0]), F(args[1]), W(args[2]));
-            } else if (IS_F(args[0]) && IS_F(args[1]) && IS_F(args[2])) {
-              ffff_t f = (ffff_t) func;
-              r = f(F(args[0]), F(args[1]), F(args[2]));
-            } else {
-              // The above checks should be exhaustive
-              abort();
-            }
-            break;
-          default:
-            return -1;
-        }
+// Up to 6 word-sized arguments
+#define FFI_WORDS(p, rt, fld)                                             \
+  FFI_THUNK(p##4w, rt, fld, (WT, WT, WT, WT), (W(0), W(1), W(2), W(3)))   \
+  FFI_THUNK(p##5w, rt, fld, (WT, WT, WT, WT, WT),                         \
+            (W(0), W(1), W(2), W(3), W(4)))                               \
+  FFI_THUNK(p##6w, rt, fld, (WT, WT, WT, WT, WT, WT),                     \
+            (W(0), W(1), W(2), W(3), W(4), W(5)))                         \
+  static const ffi_thunk_t s_ffi_##p##w[] = {ffi_##p##4w, ffi_##p##5w,    \
+                                             ffi_##p##6w};
+
+// Up to 3 arguments, each either a word or a type T float. Trampolines are
+// indexed by the mask of float arguments, see ffi_prepare()
+#define FFI_MIXED(p, rt, fld, x, T, X)                                    \
+  FFI_THUNK(p##x##w, rt, fld, (T, WT), (X(0), W(1)))                      \
+  FFI_THUNK(p##w##x, rt, fld, (WT, T), (W(0), X(1)))                      \
+  FFI_THUNK(p##x##x, rt, fld, (T, T), (X(0), X(1)))                       \
+  FFI_THUNK(p##x##w##w, rt, fld, (T, WT, WT), (X(0), W(1), W(2)))         \
+  FFI_THUNK(p##w##x##w, rt, fld, (WT, T, WT), (W(0), X(1), W(2)))         \
+  FFI_THUNK(p##x##x##w, rt, fld, (T, T, WT), (X(0), X(1), W(2)))          \
+  FFI_THUNK(p##w##w##x, rt, fld, (WT, WT, T), (W(0), W(1), X(2)))         \
+  FFI_THUNK(p##x##w##x, rt, fld, (T, WT, T), (X(0), W(1), X(2)))          \
+  FFI_THUNK(p##w##x##x, rt, fld, (WT, T, T), (W(0), X(1), X(2)))          \
+  FFI_THUNK(p##x##x##x, rt, fld, (T, T, T), (X(0), X(1), X(2)))           \
+  static const ffi_thunk_t s_ffi_##p##x[] = {                             \
+      ffi_##p##x##w,    ffi_##p##w##x,    ffi_##p##x##x,                  \
+      ffi_##p##x##w##w, ffi_##p##w##x##w, ffi_##p##x##x##w,               \
+      ffi_##p##w##w##x, ffi_##p##x##w##x, ffi_##p##w##x##x,               \
+      ffi_##p##x##x##x};
+
+#ifdef JS_NUM_INT32
+// No float math: float and double arguments and return values are rejected
+#define FFI_RET_TYPES "spvbi"
+#define FFI_TYPES "[usmbjpi"
+#define FFI_FAMILY(p, rt, fld) FFI_WORDS(p, rt, fld)
+
+FFI_FAMILY(w, WT, i)
+FFI_FAMILY(b, bool, i)
+
+// Trampoline tables, indexed by enum ffi_ctype of the return value
+static const ffi_thunk_t *s_ffi_words[] = {s_ffi_ww, s_ffi_bw};
+#else
+#define FFI_RET_TYPES "spfdvbi"
+#define FFI_TYPES "[usmbfdjpi"
+#define FFI_FAMILY(p, rt, fld)       \
+  FFI_WORDS(p, rt, fld)              \
+  FFI_MIXED(p, rt, fld, f, float, F) \
+  FFI_MIXED(p, rt, fld, d, double, D)
+
+FFI_FAMILY(w, WT, i)
+FFI_FAMILY(b, bool, i)
+FFI_FAMILY(f, float, f)
+FFI_FAMILY(d, double, d)
+
+// Trampoline tables, indexed by enum ffi_ctype of the return value
+static const ffi_thunk_t *s_ffi_words[] = {s_ffi_ww, s_ffi_bw, s_ffi_fw,
+                                           s_ffi_dw};
+static const ffi_thunk_t *s_ffi_floats[] = {s_ffi_wf, s_ffi_bf, s_ffi_ff,
+                                            s_ffi_df};
+static const ffi_thunk_t *s_ffi_doubles[] = {s_ffi_wd, s_ffi_bd, s_ffi_fd,
+                                             s_ffi_dd};
+#endif
+
+#undef W
+#undef D
+#undef F
+#undef WT
+
+static enum ffi_ctype ffi_ctypeof(char c) {
+  // clang-format off
+  switch (c) {
+    case 'f': return FFI_CTYPE_FLOAT;
+    case 'd': return FFI_CTYPE_DOUBLE;
+    case 'b': return FFI_CTYPE_BOOL;
+    default: return FFI_CTYPE_WORD;
+  }
+  // clang-format on
+}
+
+// Parse function declaration once, when the function is imported: record
+// argument kinds and the callback position, and pick a call trampoline.
+// On error, thunk is left NULL
+static void ffi_prepare(struct ffi *ff, const struct cfunc *cf) {
+  const char *s = cf->decl;
+  int i, n = 0, floats = 0, doubles = 0, mask = 0;
+  enum ffi_ctype rt = ffi_ctypeof(s[0]);
+  ff->cf = cf;
+  ff->thunk = NULL, ff->cbdecl = NULL, ff->cbslot = FFI_MAX_ARGS_CNT;
+  ff->nargs = 0;
+  if (s[0] == '\0' || strchr(FFI_RET_TYPES, s[0]) == NULL) return;
+  for (i = 1; s[i] != '\0'; i++, n++) {
+    if (n >= FFI_MAX_ARGS_CNT || strchr(FFI_TYPES, s[i]) == NULL) return;
+    ff->args[n] = s[i];
+    if (s[i] == 'f') floats++, mask |= 1 << n;
+    if (s[i] == 'd') doubles++, mask |= 1 << n;
+    if (s[i] == '[') {
+      int j = 0;
+      ff->cbdecl = &s[i + 1];  // Points to the callback return value type
+      if (s[i + 1] != '\0' && s[i + 1] != ']') i++;
+      while (s[i + 1] != '\0' && s[i] != ']') {
+        i++;
+        if (s[i] == 'u') ff->cbslot = (uint8_t) j;
+        if (j < FFI_MAX_ARGS_CNT) j++;
       }
-      res->v.f = (float) r;
-    } break;
+    }
+  }
+  ff->nargs = (uint8_t) n;
+  if (floats == 0 && doubles == 0) {
+    ff->thunk = s_ffi_words[rt][n <= 4 ? 0 : n - 4];
+#ifndef JS_NUM_INT32
+  } else if (n <= 3 && (floats == 0 || doubles == 0)) {
+    // Doubles and floats are not supported together atm
+    const ffi_thunk_t *tab = floats ? s_ffi_floats[rt] : s_ffi_doubles[rt];
+    ff->thunk = tab[n <= 2 ? mask - 1 : mask + 2];
+#endif
   }
-
-  return 0;
 }
 
 struct fficbparam {
-  struct parser *p;
+  struct elk *vm;
   const char *decl;
   jsval_t jsfunc;
 };
 
 static ffi_word_t fficb(struct fficbparam *cbp, union ffi_val *args) {
-  char buf[100];
-  int num_args = 0, n = 0;
+  struct elk *vm = cbp->vm;
+  jsval_t argv[FFI_MAX_ARGS_CNT], res;
+  int argc = 0;
   const char *s;
-  struct parser p2;
-  jsval_t res;
   for (s = cbp->decl + 1; *s != '\0' && *s != ']'; s++) {
+    if (argc >= FFI_MAX_ARGS_CNT) return 0;
     // clang-format off
-    if (num_args > 0 && n < (int) sizeof(buf)) buf[n++] = ',';
     switch (*s) {
-      case 'i': n += snprintf(buf + n, sizeof(buf) - n, "%d", (int) args[num_args].i); break;
-      case 'p': n += snprintf(buf + n, sizeof(buf) - n, "'%lx'", (unsigned long) args[num_args].i); break;
-      default: n += snprintf(buf + n, sizeof(buf) - n, "null"); break;
+      case 'i': argv[argc] = mk_int((int) args[argc].i); break;
+      case 'p': argv[argc] = mk_ptr(vm, (void *) (ffi_word_t) args[argc].i); break;
+      default: argv[argc] = JS_NULL; break;
     }
     // clang-format on
-    num_args++;
+    if (argv[argc++] == JS_ERROR) return 0;
   }
-  if (n < (int) sizeof(buf)) buf[n++] = ')';
-  if (n < (int) sizeof(buf)) buf[n++] = '\0';
-  DEBUG(("%s: %p %s\n", __func__, cbp, buf));
-  p2 = mk_parser(cbp->p->vm, buf, n);
-  pnext(&p2);
-  call_js_function(&p2, cbp->jsfunc);
-  res = *vm_top(cbp->p->vm);
-  // printf("js cb res: %s\n", tostr(cbp->p->vm, res));
-  return (ffi_word_t) tof(res);
+  DEBUG(("%s: %p %d args\n", __func__, cbp, argc));
+  res = js_call(vm, cbp->jsfunc, argv, argc);
+  // printf("js cb res: %s\n", tostr(vm, res));
+  return js_type(res) == JS_TYPE_NUMBER ? (ffi_word_t) toi32(res) : 0;
 }
 
 static void ffiinitcbargs(union ffi_val *args, ffi_word_t w1, ffi_word_t w2,
@@ -1809,6 +3247,9 @@ static void ffiinitcbargs(union ffi_val *args, ffi_word_t w1, ffi_word_t w2,
   args[5].i = w6;
 }
 
+typedef ffi_word_t (*ffi_cb_t)(ffi_word_t, ffi_word_t, ffi_word_t, ffi_word_t,
+                              ffi_word_t, ffi_word_t);
+
 static ffi_word_t fficb1(ffi_word_t w1, ffi_word_t w2, ffi_word_t w3,
                          ffi_word_t w4, ffi_word_t w5, ffi_word_t w6) {
   union ffi_val args[FFI_MAX_ARGS_CNT];
@@ -1851,499 +3292,553 @@ static ffi_word_t fficb6(ffi_word_t w1, ffi_word_t w2, ffi_word_t w3,
   return fficb((struct fficbparam *) w6, args);
 }
 
-static w6w_t setfficb(struct parser *p, jsval_t jsfunc, struct fficbparam *cbp,
-                      const char *decl, int *idx) {
-  w6w_t res = 0, cbs[] = {fficb1, fficb2, fficb3, fficb4, fficb5, fficb6, 0};
-  int i = 0;
-  cbp->p = p;
+static cfn_t setfficb(struct elk *vm, jsval_t jsfunc, struct fficbparam *cbp,
+                     const struct ffi *ff) {
+  static const ffi_cb_t cbs[] = {fficb1, fficb2, fficb3, fficb4,
+                                 fficb5, fficb6, 0};
+  cbp->vm = vm;
   cbp->jsfunc = jsfunc;
-  cbp->decl = decl + *idx + 1;
-  if (decl[*idx] != ']') (*idx)++;  // Skip callback return value type
-  while (decl[*idx + 1] != '\0' && decl[*idx] != ']') {
-    (*idx)++;
-    if (decl[*idx] == 'u') res = cbs[i];
-    if (cbs[i] != NULL) i++;
-  }
-  return res;
-}
-
-static jsval_t wtoval(struct elk *vm, ffi_word_t w) {
-  char buf[20];
-  return mk_str(vm, buf, snprintf(buf, sizeof(buf), "%lx", w));
+  cbp->decl = ff->cbdecl;
+  return (cfn_t) cbs[ff->cbslot];
 }
 
+// Pointers are passed as pointer values. With JS_VAL64, numbers are
+// taken as addresses too, since doubles hold 48-bit pointers exactly
 static ffi_word_t valtow(struct elk *vm, jsval_t v) {
-  ffi_word_t ret = 0;
-  if (js_type(v) == JS_TYPE_STRING) {
-    const char *s = js_to_str(vm, v, 0);
-    sscanf(s, "%lx", &ret);
+#ifdef JS_VAL64
+  if (js_type(v) == JS_TYPE_NUMBER) {
+    double d = tof(v);  // Address, or 0 if it does not fit
+    return d > -9e18 && d < 9e18 ? (ffi_word_t)(int64_t) d : 0;
   }
-  return ret;
+#endif
+  return (ffi_word_t) toptr(vm, v);
 }
 
-static struct cfunc *findcfunc(struct elk *vm, ind_t id) {
-  struct cfunc *p;
-  for (p = vm->cfuncs; p != NULL; p = p->next) {
-    if (p->id == id) return p;
+// Append the arguments to the array, return its new length
+static jsval_t call_arr_push(struct elk *vm, jsval_t f, int num_passed_args) {
+  jsval_t res, arr = MK_VAL(JS_TYPE_ARRAY, VAL_PAYLOAD(f) & ~ARR_PUSH);
+  jsval_t *top = vm_top(vm) - num_passed_args;
+  jsint_t len = (jsint_t) arr_block(vm, arr)[ARR_LEN];
+  int i;
+  for (i = 0; i < num_passed_args; i++) {
+    TRY(arr_set(vm, arr, len + i, top[i + 1]));
   }
-  return NULL;
+  vm->sp = (ind_t)(top - vm->data_stack);  // Drop the args and the function
+  return vm_push(vm, mk_int(arr_block(vm, arr)[ARR_LEN]));
 }
 
-static jsval_t call_c_function(struct parser *p, jsval_t f) {
-  struct cfunc *cf = findcfunc(p->vm, (ind_t) VAL_PAYLOAD(f));
-  jsval_t res = JS_UNDEFINED, v = JS_UNDEFINED, *top = vm_top(p->vm);
-  struct ffi_arg args[FFI_MAX_ARGS_CNT + 1];  // First arg - return value
+// Call C function. The function and its arguments are on stack
+static jsval_t call_c_function(struct elk *vm, jsval_t f, int num_passed_args) {
+  ind_t id = (ind_t) VAL_PAYLOAD(f);
+  const struct ffi *ff = id < vm->ncfuncs ? &vm->cfuncs[id] : NULL;
+  jsval_t v = JS_UNDEFINED, *top = vm_top(vm) - num_passed_args;
+  union ffi_val args[FFI_MAX_ARGS_CNT], res;  // Unused args are passed as 0
   struct fficbparam cbp;                      // For C callbacks only
-  int i, num_passed_args = 0, num_expected_args = 0;
+  int i;
 
-  // Evaluate all JS parameters passed to the C function, push them on stack
-  while (p->tok.tok != ')') {
-    TRY(parse_expr(p));               // Push to the data_stack
-    if (p->tok.tok == ',') pnext(p);  // Skip to the next arg
-    num_passed_args++;
+  if (VAL_PAYLOAD(f) & ARR_PUSH) return call_arr_push(vm, f, num_passed_args);
+  if (ff == NULL) return vm_err(vm, "bad cfunc %d", (int) id);
+  if (ff->thunk == NULL) return vm_err(vm, "bad ffi decl '%s'", ff->cf->decl);
+  if (num_passed_args != ff->nargs) {
+    return vm_err(vm, "ffi call %s: %d vs %d", ff->cf->decl, ff->nargs,
+                  num_passed_args);
   }
-
-  // clang-format off
-	// Set type of the return value
   memset(args, 0, sizeof(args));
   memset(&cbp, 0, sizeof(cbp));
-	//printf("--> cbp %p\n", &cbp);
-	switch (cf->decl[0]) {
-		case 'f': args[0].ctype = FFI_CTYPE_FLOAT; break;
-		case 'd': args[0].ctype = FFI_CTYPE_DOUBLE; break;
-		case 'b': args[0].ctype = FFI_CTYPE_BOOL; break;
-		default: args[0].ctype = FFI_CTYPE_WORD; break;
-	}
-	// Prepare FFI arguments - fetch them from the passed JS arguments
-	for (i = 1; cf->decl[i] != '\0'; i++) {  // Start from 1 to skip ret value
-		struct ffi_arg *arg = &args[num_expected_args + 1];
-		jsval_t av = top[num_expected_args + 1];
-		//printf("--> arg [%c] [%s]\n", cf->decl[i], tostr(p->vm, av));
-		switch (cf->decl[i]) {
-			case '[': ffi_set_ptr(arg, (void *) setfficb(p, av, &cbp, cf->decl, &i)); break;
-			case 'u': ffi_set_ptr(arg, &cbp); break;
-			case 's': ffi_set_ptr(arg, js_to_str(p->vm, av, 0)); break;
-			case 'm': ffi_set_ptr(arg, p->vm); break;
-			case 'b': ffi_set_bool(arg, av == JS_TRUE ? 1 : 0); break;
-			case 'f': ffi_set_float(arg, tof(av)); break;
-			case 'd': ffi_set_double(arg, (double) tof(av)); break;
-			case 'j': ffi_set_word(arg, (ffi_word_t) av); break;
-			case 'p': ffi_set_word(arg, valtow(p->vm, av)); break;
-			case 'i': ffi_set_word(arg, (int) tof(av)); break;
-			default: return  vm_err(p->vm, "bad ffi type '%c'", cf->decl[i]); break;
-		}
-		num_expected_args++;
-	}
-
-	if (num_passed_args != num_expected_args) return vm_err(p->vm, "ffi call %s: %d vs %d", cf->decl, num_expected_args, num_passed_args);
-
-	ffi_call(cf->fn, num_passed_args, &args[0], &args[1]);
-	switch (cf->decl[0]) {
-		case 's': v = mk_str(p->vm, (char *) args[0].v.i, -1); break;
-		case 'p': v = wtoval(p->vm, args[0].v.w); break;
-		case 'f': v = tov(args[0].v.f); break;
-		case 'd': v = tov((float) args[0].v.d); break;
-		case 'v': v = JS_UNDEFINED; break;
-		case 'b': v = args[0].v.i ? JS_TRUE : JS_FALSE; break;
-		case 'i': v = tov((float) args[0].v.i); break;
-		default: v = vm_err(p->vm, "bad ret type '%c'", cf->decl[0]); break;
-	}
+
+  // clang-format off
+  // Prepare FFI arguments - fetch them from the passed JS arguments
+  for (i = 0; i < num_passed_args; i++) {
+    jsval_t av = top[i + 1];
+    if (ff->args[i] == 's' && (av = str_flatten(vm, av)) == JS_ERROR) return av;
+    switch (ff->args[i]) {
+      case '[': args[i].i = (ffi_word_t) setfficb(vm, av, &cbp, ff); break;
+      case 'u': args[i].i = (ffi_word_t) &cbp; break;
+      case 's': args[i].i = (ffi_word_t) js_to_str(vm, av, 0); break;
+      case 'm': args[i].i = (ffi_word_t) vm; break;
+      case 'b': args[i].i = av == JS_TRUE ? 1 : 0; break;
+#ifndef JS_NUM_INT32
+      case 'f': args[i].f = (float) tof(av); break;
+      case 'd': args[i].d = (double) tof(av); break;
+#endif
+      case 'j': args[i].i = (ffi_word_t) av; break;
+      case 'p': args[i].i = valtow(vm, av); break;
+      default: args[i].i = (ffi_word_t) toi32(av); break;
+    }
+  }
+
+  ff->thunk(ff->cf->fn, &res, args);
+  switch (ff->cf->decl[0]) {
+    case 's': v = mk_str(vm, (char *) res.i, -1); break;
+    case 'p': v = mk_ptr(vm, (void *) res.w); break;
+#ifndef JS_NUM_INT32
+    case 'f': v = dtov(res.f); break;
+    case 'd': v = dtov(res.d); break;
+#endif
+    case 'v': v = JS_UNDEFINED; break;
+    case 'b': v = res.i ? JS_TRUE : JS_FALSE; break;
+    default: v = mk_int((int) res.i); break;
+  }
   // clang-format on
-        while (vm_top(p->vm) > top) vm_drop(p->vm);  // Abandon pushed args
-        vm_drop(p->vm);                              // Abandon function object
-        DEBUG(("%s: %d\n", __func__, p->tok.tok));
-        return vm_push(p->vm, v);  // Push call result
-}
+  while (vm_top(vm) > top) vm_drop(vm);  // Abandon pushed args
+  vm_drop(vm);                           // Abandon function object
+  DEBUG(("%s: %s\n", __func__, tostr(vm, v)));
+  return vm_push(vm, v);  // Push call result
+}
+
+// Like TRY, for instructions that leave the stacks intact when they fail,
+// and that have no other side effects. If such an instruction fails, maybe
+// for the lack of memory, collect garbage and run it again, once
+#define TRY_GC(expr)                     \
+  do {                                   \
+    res = expr;                          \
+    if (res == JS_ERROR && !collected) { \
+      js_gc(vm);                         \
+      collected = true;                  \
+      goto again;                        \
+    }                                    \
+    if (res == JS_ERROR) return res;     \
+  } while (0)
 
-static jsval_t parse_call_dot_mem(struct parser *p, int prev_op) {
+// Execute bytecode until OP_RET, leaving the result on stack
+static jsval_t vm_exec(struct elk *vm, ind_t pc) {
   jsval_t res = JS_TRUE;
-  TRY(parse_literal(p, p->tok.tok));
-  while (p->tok.tok == '.' || p->tok.tok == '(' || p->tok.tok == '[') {
-    // printf("%s: [%.*s]\n", __func__, p->tok.len, p->tok.ptr);
-    if (p->tok.tok == '[') {
-      jstok_t prev_tok = p->prev_tok;
-      pnext(p);
-      TRY(parse_expr(p));
-      EXPECT(p, ']');
-      pnext(p);
-      if (!findtok(s_assign_ops, p->tok.tok) &&
-          !findtok(s_postfix_ops, p->tok.tok) &&
-          !findtok(s_postfix_ops, prev_tok)) {
-        jsval_t v = JS_UNDEFINED, *top = vm_top(p->vm);
-        if (js_type(top[0]) == JS_TYPE_NUMBER &&
-            js_type(top[-1]) == JS_TYPE_STRING) {
-          jslen_t len, idx = tof(top[0]);
-          const char *s = js_to_str(p->vm, top[-1], &len);
-          if (idx < len) v = mk_str(p->vm, s + idx, 1);
+  for (;;) {
+    const uint8_t *ip = &vm->code[pc];
+    const char *name = (const char *) ip + 2;  // Name operand, if any
+    bool collected = gc_needed(vm);
+    if (collected) js_gc(vm);
+  again:
+    DEBUG(("%s: pc %d op %d sp %d\n", __func__, pc, ip[0], vm->sp));
+    switch (ip[0]) {
+      case OP_RET:
+        return JS_TRUE;
+      case OP_PUSH:
+        TRY(vm_push(vm, get_val(ip + 1)));
+        pc = (ind_t)(pc + 1 + sizeof(jsval_t));
+        break;
+      case OP_STR:
+        TRY_GC(mk_str(vm, name, ip[1]));
+        TRY(vm_push(vm, res));
+        pc = (ind_t)(pc + 2 + ip[1]);
+        break;
+      case OP_LSTR:
+        TRY_GC(mk_str(vm, (const char *) ip + 1 + IND_SIZE, get_ind(ip + 1)));
+        TRY(vm_push(vm, res));
+        pc = (ind_t)(pc + 1 + IND_SIZE + get_ind(ip + 1));
+        break;
+      case OP_GET:
+      case OP_REF: {
+        uint8_t *ic = &vm->code[pc + 2 + ip[1]];
+        jsval_t *v = lookup_ic(vm, ic, name, ip[1]);
+        if (v == NULL) return vm_err(vm, "[%.*s] undefined", ip[1], name);
+        if (ip[0] == OP_GET) {
+          TRY(vm_push(vm, *v));
         } else {
-          v = vm_err(p->vm, "pls index strings by num");
+          TRY(vm_push(vm, mk_ref(vm, v)));
         }
-        vm_drop(p->vm);
-        vm_drop(p->vm);
-        vm_push(p->vm, v);
+        pc = (ind_t)(pc + 2 + ip[1] + IC_GET_SIZE);
+        break;
       }
-    } else if (p->tok.tok == '(') {
-      pnext(p);
-      // printf("%s: [%.*s] %d\n", __func__, p->tok.len, p->tok.ptr, p->noexec);
-      if (p->noexec) {
-        while (p->tok.tok != ')') {
-          TRY(parse_expr(p));
-          if (p->tok.tok == ',') pnext(p);
+      case OP_LET: {
+        jsval_t key, obj = vm->call_stack[vm->csp - 1];
+        if (js_type(obj) != JS_TYPE_OBJECT) {
+          // Function level: locals go to a scope object, made on first use
+          if (frame_find(vm, obj, name, ip[1]) != NULL) {
+            return vm_err(vm, "[%.*s] already declared", ip[1], name);
+          }
+          TRY_GC(obj = create_scope(vm));
         }
-      } else {
-        jsval_t f = *vm_top(p->vm);
-        js_type_t t = js_type(f);
-        if (t == JS_TYPE_FUNCTION) {
-          res = call_js_function(p, f);
-        } else if (t == JS_TYPE_C_FUNCTION) {
-          res = call_c_function(p, f);
-        } else {
-          res = vm_err(p->vm, "calling non-func");
+        if (findprop(vm, obj, name, ip[1]) != NULL) {
+          return vm_err(vm, "[%.*s] already declared", ip[1], name);
         }
+        TRY_GC(key = mk_key(vm, name, ip[1]));  // Run again: scope is there
+        TRY_GC(js_set(vm, obj, key, *vm_top(vm)));
+        pc = (ind_t)(pc + 2 + ip[1]);
+        break;
       }
-      EXPECT(p, ')');
-      pnext(p);
-    } else if (p->tok.tok == '.') {
-      jsval_t v = *vm_top(p->vm);
-      pnext(p);
-      if (!p->noexec) {
-        if (p->tok.len == 6 && memcmp(p->tok.ptr, "length", 6) == 0 &&
+      case OP_DOT: {
+        jsval_t v = *vm_top(vm);
+        if (ip[1] == 6 && memcmp(name, "length", 6) == 0 &&
             js_type(v) == JS_TYPE_STRING) {
-          jslen_t len;
-          js_to_str(p->vm, v, &len);
-          vm_drop(p->vm);
-          res = vm_push(p->vm, tov(len));
+          *vm_top(vm) = MK_SMI(str_len(vm, v));
+        } else if (ip[1] == 6 && memcmp(name, "length", 6) == 0 &&
+                   tobuf(vm, v) != NULL) {
+          *vm_top(vm) = mk_int(tobuf(vm, v)->len);
+        } else if (js_type(v) == JS_TYPE_ARRAY) {
+          if (ip[1] == 6 && memcmp(name, "length", 6) == 0) {
+            *vm_top(vm) = mk_int(arr_block(vm, v)[ARR_LEN]);
+          } else if (ip[1] == 4 && memcmp(name, "push", 4) == 0) {
+            *vm_top(vm) = MK_VAL(JS_TYPE_C_FUNCTION, VAL_PAYLOAD(v) | ARR_PUSH);
+          } else {
+            *vm_top(vm) = JS_UNDEFINED;
+          }
         } else if (js_type(v) != JS_TYPE_OBJECT) {
-          res = vm_push(p->vm, vm_err(p->vm, "lookup in non-obj"));
+          return vm_err(vm, "lookup in non-obj");
         } else {
-          jsval_t *prop = findprop(p->vm, v, p->tok.ptr, p->tok.len);
-          vm_drop(p->vm);
-          res = vm_push(p->vm, prop == NULL ? JS_UNDEFINED : *prop);
+          uint8_t *ic = &vm->code[pc + 2 + ip[1]];
+          jsval_t *prop = findprop_ic(vm, ic, v, name, ip[1]);
+          *vm_top(vm) = prop == NULL ? JS_UNDEFINED : *prop;
         }
+        pc = (ind_t)(pc + 2 + ip[1] + IC_DOT_SIZE);
+        break;
       }
-      pnext(p);
+      case OP_SETKEY: {
+        jsval_t key, *top = vm_top(vm);
+        TRY_GC(key = mk_key(vm, name, ip[1]));
+        TRY_GC(js_set(vm, top[-1], key, top[0]));
+        vm_drop(vm);
+        pc = (ind_t)(pc + 2 + ip[1]);
+        break;
+      }
+      case OP_INDEX: {
+        jsval_t *top = vm_top(vm);
+        TRY_GC(get_elem(vm, top[-1], top[0]));
+        vm_drop(vm);
+        *vm_top(vm) = res;
+        pc++;
+        break;
+      }
+      case OP_INDEXREF:
+        TRY(vm_push(vm, ELEM_REF));  // Keep the object and the index
+        pc++;
+        break;
+      case OP_OBJ:
+        TRY_GC(mk_obj(vm));
+        TRY(vm_push(vm, res));
+        pc++;
+        break;
+      case OP_ARR:
+        TRY_GC(mk_arr(vm));
+        TRY(vm_push(vm, res));
+        pc++;
+        break;
+      case OP_APPEND: {
+        jsval_t *top = vm_top(vm);
+        TRY_GC(arr_set(vm, top[-1],
+                       (jsint_t) arr_block(vm, top[-1])[ARR_LEN], top[0]));
+        vm_drop(vm);
+        pc++;
+        break;
+      }
+      case OP_FUNC:
+        TRY(vm_push(vm, MK_VAL(JS_TYPE_FUNCTION, pc + 1)));
+        pc = get_ind(ip + 1 + FN_END);
+        break;
+      case OP_CALL: {
+        jsval_t f = vm->data_stack[vm->sp - ip[1] - 1];
+        if (js_type(f) == JS_TYPE_FUNCTION) {
+          TRY(call_js_function(vm, f, ip[1]));
+        } else if (js_type(f) == JS_TYPE_C_FUNCTION) {
+          TRY(call_c_function(vm, f, ip[1]));
+        } else {
+          return vm_err(vm, "calling non-func");
+        }
+        pc = (ind_t)(pc + 2);
+        break;
+      }
+      case OP_OP:
+        TRY_GC(do_op(vm, get32(ip + 1)));
+        pc = (ind_t)(pc + 5);
+        break;
+      case OP_DROP:
+        vm_drop(vm);
+        pc++;
+        break;
+      case OP_JMP:
+        pc = get_ind(ip + 1);
+        break;
+      case OP_JZ: {
+        int cond = is_true(vm, *vm_top(vm));
+        vm_drop(vm);
+        pc = cond ? (ind_t)(pc + 1 + IND_SIZE) : get_ind(ip + 1);
+        break;
+      }
+      case OP_JZ_KEEP:
+      case OP_JNZ_KEEP:
+        if (is_true(vm, *vm_top(vm)) == (ip[0] == OP_JZ_KEEP)) {
+          vm_drop(vm);
+          pc = (ind_t)(pc + 1 + IND_SIZE);
+        } else {
+          pc = get_ind(ip + 1);
+        }
+        break;
+      case OP_ENTER:
+        TRY_GC(create_scope(vm));
+        pc++;
+        break;
+      case OP_LEAVE:
+        TRY(delete_scope(vm));
+        pc++;
+        break;
+      case OP_SLOT:
+        TRY(vm_push(vm, vm->data_stack[vm->fp + ip[1]]));
+        pc = (ind_t)(pc + 2);
+        break;
+      case OP_SLOTREF:
+        TRY(vm_push(vm, MK_SMI(-1 - (jsint_t)(vm->fp + ip[1]))));
+        pc = (ind_t)(pc + 2);
+        break;
+      default:
+        return vm_err(vm, "bad opcode %d", ip[0]);
     }
   }
-  (void) prev_op;
-  return res;
 }
 
-static jsval_t parse_postfix(struct parser *p, int prev_op) {
-  jsval_t res = JS_TRUE;
-  TRY(parse_call_dot_mem(p, prev_op));
-  if (p->tok.tok == DT('+', '+') || p->tok.tok == DT('-', '-')) {
-    int op = p->tok.tok == DT('+', '+') ? TOK_POSTFIX_PLUS : TOK_POSTFIX_MINUS;
-    TRY(do_op(p, op));
-    pnext(p);
-  }
-  return res;
-}
+/////////////////////////////// EXTERNAL API /////////////////////////////////
 
-static jsval_t parse_unary(struct parser *p, int prev_op) {
-  jsval_t res = JS_TRUE;
-  int op = TOK_EOF;
-  if (findtok(s_unary_ops, p->tok.tok) != TOK_EOF) {
-    op = p->tok.tok;
-    pnext(p);
-  }
-  if (findtok(s_unary_ops, p->tok.tok) != TOK_EOF) {
-    res = parse_unary(p, prev_op);
-  } else {
-    res = parse_postfix(p, prev_op);
+static const struct js_limits s_default_limits = {
+    JS_DATA_STACK_SIZE, JS_CALL_STACK_SIZE, JS_OBJ_POOL_SIZE, JS_PROP_POOL_SIZE,
+    JS_STRING_POOL_SIZE, JS_CODE_SIZE,      JS_PROP_INDEX_SIZE,
+    JS_ARRAY_POOL_SIZE,  JS_CFUNC_SIZE,     JS_HANDLE_SIZE,
+};
+
+// Alignment of union js_align: the offset of a member that follows a char
+struct vm_align {
+  char c;
+  union js_align a;
+};
+#define VM_ALIGN ((unsigned long) offsetof(struct vm_align, a))
+
+// Place a region of the given size at offset *n, and advance *n past it,
+// rounded up to VM_ALIGN. Return the region offset
+static unsigned long vm_region(unsigned long *n, unsigned long size) {
+  unsigned long ofs = *n;
+  *n = (ofs + size + VM_ALIGN - 1) / VM_ALIGN * VM_ALIGN;
+  return ofs;
+}
+
+// Lay out the pools after the VM structure. Every region, and the total
+// size, is aligned as union js_align, so VMs can be packed back to back.
+// Return the total size, or 0 if limits are invalid. If vm is not NULL,
+// point its pools to their place
+static unsigned long vm_layout(struct elk *vm, const struct js_limits *l) {
+  unsigned long n = 0, ofs[11];
+  if (l->data_stack < 1 || l->call_stack < 1 || l->objs < 1 || l->props < 1 ||
+      l->props > INVALID_INDEX / 2) {
+    return 0;  // Need a global object, and an atom table that fits ind_t
   }
-  if (res == JS_ERROR) return res;
-  if (op != TOK_EOF) {
-    if (op == '-') op = TOK_UNARY_MINUS;
-    if (op == '+') op = TOK_UNARY_PLUS;
-    do_op(p, op);
+  vm_region(&n, sizeof(struct elk));
+  ofs[9] = vm_region(&n, l->cfuncs * sizeof(struct ffi));
+  ofs[10] = vm_region(&n, l->handles * sizeof(struct handle));
+  ofs[0] = vm_region(&n, l->data_stack * sizeof(jsval_t));
+  ofs[1] = vm_region(&n, l->call_stack * sizeof(jsval_t));
+  ofs[2] = vm_region(&n, l->elems * sizeof(jsval_t));
+  ofs[3] = vm_region(&n, l->props * sizeof(struct prop));
+  ofs[4] = vm_region(&n, l->objs * sizeof(struct obj));
+  ofs[5] = vm_region(&n, l->props * 2 * sizeof(ind_t));
+#if JS_PROP_INDEX_SIZE > 0
+  ofs[6] = vm_region(&n, l->pindex * sizeof(struct pindex));
+#endif
+  ofs[7] = vm_region(&n, l->strings);
+  ofs[8] = vm_region(&n, l->code);
+  if (vm != NULL) {
+    vm->data_stack = (jsval_t *) ((char *) vm + ofs[0]);
+    vm->call_stack = (jsval_t *) ((char *) vm + ofs[1]);
+    vm->elems = (jsval_t *) ((char *) vm + ofs[2]);
+    vm->props = (struct prop *) ((char *) vm + ofs[3]);
+    vm->objs = (struct obj *) ((char *) vm + ofs[4]);
+    vm->atoms = (ind_t *) ((char *) vm + ofs[5]);
+#if JS_PROP_INDEX_SIZE > 0
+    vm->pindex = (struct pindex *) ((char *) vm + ofs[6]);
+#endif
+    vm->stringbuf = (uint8_t *) vm + ofs[7];
+    vm->code = (uint8_t *) vm + ofs[8];
+    vm->cfuncs = (struct ffi *) ((char *) vm + ofs[9]);
+    vm->handles = (struct handle *) ((char *) vm + ofs[10]);
   }
-  return res;
-}
-
-static jsval_t parse_mul_div_rem(struct parser *p, int prev_op) {
-  jstok_t ops[] = {'*', '/', '%', TOK_EOF};
-  return parse_ltr_binop(p, parse_unary, parse_mul_div_rem, ops, prev_op);
-}
-
-static jsval_t parse_plus_minus(struct parser *p, int prev_op) {
-  jstok_t ops[] = {'+', '-', TOK_EOF};
-  return parse_ltr_binop(p, parse_mul_div_rem, parse_plus_minus, ops, prev_op);
-}
-
-static jsval_t parse_shifts(struct parser *p, int prev_op) {
-  jstok_t ops[] = {DT('<', '<'), DT('>', '>'), TT('>', '>', '>'), TOK_EOF};
-  return parse_ltr_binop(p, parse_plus_minus, parse_shifts, ops, prev_op);
-}
-
-static jsval_t parse_comparison(struct parser *p, int prev_op) {
-  return parse_ltr_binop(p, parse_shifts, parse_comparison, s_cmp_ops, prev_op);
-}
-
-static jsval_t parse_equality(struct parser *p, int prev_op) {
-  return parse_ltr_binop(p, parse_comparison, parse_equality, s_equality_ops,
-                         prev_op);
+  return n;
 }
 
-static jsval_t parse_bitwise_and(struct parser *p, int prev_op) {
-  jstok_t ops[] = {'&', TOK_EOF};
-  return parse_ltr_binop(p, parse_equality, parse_bitwise_and, ops, prev_op);
+unsigned long js_size(const struct js_limits *limits) {
+  return vm_layout(NULL, limits == NULL ? &s_default_limits : limits);
 }
 
-static jsval_t parse_bitwise_xor(struct parser *p, int prev_op) {
-  jstok_t ops[] = {'^', TOK_EOF};
-  return parse_ltr_binop(p, parse_bitwise_and, parse_bitwise_xor, ops, prev_op);
-}
-
-static jsval_t parse_bitwise_or(struct parser *p, int prev_op) {
-  jstok_t ops[] = {'|', TOK_EOF};
-  return parse_ltr_binop(p, parse_bitwise_xor, parse_bitwise_or, ops, prev_op);
+// Create VM inside of a caller's buffer, which must be aligned as union
+// js_align and be at least js_size() bytes long. The buffer is not freed by
+// js_destroy(). Return NULL if limits are invalid, or the buffer is small
+// or misaligned
+struct elk *js_create_in(void *buf, unsigned long size,
+                         const struct js_limits *limits) {
+  struct elk *vm = (struct elk *) buf;
+  unsigned long n = js_size(limits);
+  ind_t i;
+  if (buf == NULL || n == 0 || size < n) return NULL;
+  if ((size_t) buf % VM_ALIGN != 0) return NULL;
+  memset(buf, 0, n);
+  vm->lim = limits == NULL ? s_default_limits : *limits;
+#if JS_PROP_INDEX_SIZE == 0
+  vm->lim.pindex = 0;
+#endif
+  vm_layout(vm, &vm->lim);
+  // Chain all objects but the global object 0, and all props, to free lists
+  for (i = 0; i < vm->lim.objs; i++) vm->objs[i].props = (ind_t)(i + 1);
+  for (i = 0; i < vm->lim.props; i++) vm->props[i].next = (ind_t)(i + 1);
+  vm->objs[vm->lim.objs - 1].props = INVALID_INDEX;
+  vm->props[vm->lim.props - 1].next = INVALID_INDEX;
+  vm->free_objs = vm->objs[0].props;
+  vm->free_props = 0;
+  vm->objs[0].flags = OBJ_ALLOCATED;
+  vm->objs[0].props = INVALID_INDEX;
+  vm->nobjs = 1;
+  atoms_rebuild(vm);
+  gc_limits(vm);
+#if JS_PROP_INDEX_SIZE > 0
+  for (i = 0; i < vm->lim.pindex; i++) vm->pindex[i].obj = INVALID_INDEX;
+#endif
+  vm->call_stack[0] = MK_VAL(JS_TYPE_OBJECT, 0);
+  vm->csp++;
+  DEBUG(("%s: size %lu bytes\n", __func__, n));
+  return vm;
 }
 
-static jsval_t parse_logical_and(struct parser *p, int prev_op) {
-  jstok_t ops[] = {DT('&', '&'), TOK_EOF};
-  return parse_ltr_binop(p, parse_bitwise_or, parse_logical_and, ops, prev_op);
+struct elk *js_create(void) {
+  unsigned long size = js_size(NULL);
+  struct elk *vm = js_create_in(calloc(1, size), size, NULL);
+  if (vm != NULL) vm->allocated = true;
+  return vm;
 }
 
-static jsval_t parse_logical_or(struct parser *p, int prev_op) {
-  jstok_t ops[] = {DT('|', '|'), TOK_EOF};
-  return parse_ltr_binop(p, parse_logical_and, parse_logical_or, ops, prev_op);
+void js_destroy(struct elk *vm) {
+  if (vm != NULL && vm->allocated) free(vm);
 }
 
-static jsval_t parse_ternary(struct parser *p, int prev_op) {
-  jsval_t res = JS_TRUE;
-  TRY(parse_logical_or(p, TOK_EOF));
-  if (prev_op != TOK_EOF) do_op(p, prev_op);
-  if (p->tok.tok == '?') {
-    int old_noexec = p->noexec, ok = is_true(p->vm, *vm_top(p->vm));
-    if (!old_noexec) vm_drop(p->vm);
-    pnext(p);
-    if (!old_noexec) p->noexec = !ok;
-    TRY(parse_ternary(p, TOK_EOF));
-    EXPECT(p, ':');
-    pnext(p);
-    if (!old_noexec) p->noexec = ok;
-    TRY(parse_ternary(p, TOK_EOF));
-    p->noexec = old_noexec;
+jsval_t js_compile(struct elk *vm, const char *buf, int len) {
+  struct parser p = mk_parser(vm, buf, len > 0 ? len : (int) strlen(buf));
+  ind_t h = vm->code_len;
+  tokenize(&p);
+  if (emit(&p, NULL, FN_PARAMS) == JS_ERROR ||
+      parse_statement_list(&p, TOK_EOF) == JS_ERROR ||
+      emit_byte(&p, OP_RET) == JS_ERROR) {
+    vm->code_len = h;
+    return JS_ERROR;
   }
-  return res;
-}
-
-static jsval_t parse_assignment(struct parser *p, int pop) {
-  return parse_rtl_binop(p, parse_ternary, parse_assignment, s_assign_ops, pop);
-}
-
-static jsval_t parse_expr(struct parser *p) {
-  return parse_assignment(p, TOK_EOF);
+  put_ind(&vm->code[h + FN_SRC], vm->code_len);
+  put_ind(&vm->code[h + FN_END], vm->code_len);
+  DEBUG(("%s: %d bytes\n", __func__, vm->code_len - h));
+  return MK_VAL(JS_TYPE_FUNCTION, h);
 }
 
-static jsval_t parse_let(struct parser *p) {
-  jsval_t res = JS_TRUE;
-  pnext(p);
-  for (;;) {
-    struct tok tmp = p->tok;
-    jsval_t obj = p->vm->call_stack[p->vm->csp - 1], key, val = JS_UNDEFINED;
-    if (p->tok.tok != TOK_IDENT) return vm_err(p->vm, "indent expected");
-    if (findprop(p->vm, obj, p->tok.ptr, p->tok.len) != NULL) {
-      return vm_err(p->vm, "[%.*s] already declared", p->tok.len, p->tok.ptr);
-    }
-    pnext(p);
-    if (p->tok.tok == '=') {
-      pnext(p);
-      TRY(parse_expr(p));
-      val = *vm_top(p->vm);
-    } else if (!p->noexec) {
-      vm_push(p->vm, val);
-    }
-    key = mk_str(p->vm, tmp.ptr, tmp.len);
-    TRY(key);
-    TRY(js_set(p->vm, obj, key, val));
-    // DEBUG(( "%s: sp %d, %d\n", __func__, p->vm->sp, p->tok.tok));
-    if (p->tok.tok == ',') {
-      TRY(vm_drop(p->vm));
-      pnext(p);
-    }
-    if (p->tok.tok == ';' || p->tok.tok == TOK_EOF) break;
+// Run code. A C function called by the running code may run more code:
+// the nested run keeps the caller's stack below its base
+jsval_t js_run(struct elk *vm, jsval_t code) {
+  ind_t csp = vm->csp, base, fp = vm->fp;
+  jsval_t res;
+  if (js_type(code) != JS_TYPE_FUNCTION) return vm_err(vm, "not a code");
+  if (vm->nruns == 0) vm->sp = 0;  // Abandon the result of the previous run
+  base = vm->sp;
+  vm->nruns++;
+  res = vm_exec(vm, (ind_t)(VAL_PAYLOAD(code) + FN_PARAMS));
+  vm->nruns--;
+  vm->fp = fp;
+  while (vm->csp > csp) delete_scope(vm);
+  if (res == JS_ERROR) {
+    vm->sp = base;
+  } else {
+    // The result stays on stack until the next run, to keep it referenced
+    res = vm->data_stack[base] = *vm_top(vm);
+    vm->sp = (ind_t)(base + 1);
   }
   return res;
 }
 
-static jsval_t parse_return(struct parser *p) {
+// Call a JS or C function with the given arguments, and return the result
+jsval_t js_call(struct elk *vm, jsval_t fn, const jsval_t *argv, int argc) {
   jsval_t res = JS_TRUE;
-  pnext(p);
-  // It is either "return;" or "return EXPR;"
-  if (p->tok.tok == ';' || p->tok.tok == '}') {
-    if (!p->noexec) vm_push(p->vm, JS_UNDEFINED);
-  } else {
-    res = parse_expr(p);
+  ind_t sp = vm->sp;
+  int i;
+  js_type_t t = js_type(fn);
+  if (t != JS_TYPE_FUNCTION && t != JS_TYPE_C_FUNCTION) {
+    return vm_err(vm, "calling non-func");
   }
-  // Point parser to the end of func body, so that parse_block() gets '}'
-  if (!p->noexec) p->pos = p->end - 1;
-  return res;
-}
-
-static jsval_t parse_block_or_stmt(struct parser *p, int create_scope) {
-  if (lookahead(p) == '{') {
-    return parse_block(p, create_scope);
-  } else {
-    return parse_statement(p);
+  res = vm_push(vm, fn);
+  for (i = 0; i < argc && res != JS_ERROR; i++) res = vm_push(vm, argv[i]);
+  if (res != JS_ERROR) {
+    res = t == JS_TYPE_FUNCTION ? call_js_function(vm, fn, argc)
+                                : call_c_function(vm, fn, argc);
   }
-}
-
-static jsval_t parse_while(struct parser *p) {
-  jsval_t res = JS_TRUE;
-  struct parser tmp;
-  pnext(p);
-  EXPECT(p, '(');
-  pnext(p);
-  tmp = *p;  // Remember the location of the condition expression
-  for (;;) {
-    *p = tmp;  // On each iteration, re-evaluate the condition
-    TRY(parse_expr(p));
-    EXPECT(p, ')');
-    pnext(p);
-    if (is_true(p->vm, *vm_top(p->vm))) {
-      // Condition is true. Drop evaluated condition expression from the stack
-      if (!p->noexec) vm_drop(p->vm);
-    } else {
-      // TODO(lsm): optimise here, p->pos = post_condition if it is saved
-      p->noexec++;
-      DEBUG(("%s: FALSE!!.., sp %d\n", __func__, p->vm->sp));
-    }
-    TRY(parse_block_or_stmt(p, 1));
-    DEBUG(("%s: done.., sp %d\n", __func__, p->vm->sp));
-    if (p->noexec) break;
-    vm_drop(p->vm);
-    // vm_dump(p->vm);
-  }
-  DEBUG(("%s: out.., sp %d\n", __func__, p->vm->sp));
-  p->noexec = tmp.noexec;
+  if (res != JS_ERROR) res = *vm_top(vm);
+  vm->sp = sp;
   return res;
 }
 
-static jsval_t parse_if(struct parser *p) {
-  jsval_t res = JS_TRUE;
-  int saved_noexec = p->noexec, cond;
-  pnext(p);
-  EXPECT(p, '(');
-  pnext(p);
-  TRY(parse_expr(p));
-  EXPECT(p, ')');
-  pnext(p);
-  if (!p->noexec) {
-    cond = is_true(p->vm, *vm_top(p->vm));
-    vm_drop(p->vm);
-    if (!cond) {
-      vm_push(p->vm, JS_UNDEFINED);
-      p->noexec++;
-    }
+// Extend the end of used bytecode past a function defined after the mark
+static void fn_watermark(struct elk *vm, jsval_t v, ind_t mark, ind_t *end) {
+  if (js_type(v) == JS_TYPE_FUNCTION && VAL_PAYLOAD(v) >= mark) {
+    ind_t fn_end = get_ind(&vm->code[VAL_PAYLOAD(v) + FN_END]);
+    if (fn_end > *end) *end = fn_end;
   }
-  TRY(parse_block_or_stmt(p, 1));
-  p->noexec = saved_noexec;
-  return res;
 }
 
-static jsval_t parse_statement(struct parser *p) {
-  switch (p->tok.tok) {
-    case ';':
-      pnext(p);
-      return JS_TRUE;
-    case TOK_LET:
-      return parse_let(p);
-    case '{': {
-      jsval_t res = parse_block(p, 1);
-      pnext(p);
-      return res;
-    }
-    case TOK_RETURN:
-      return parse_return(p);
-    case TOK_WHILE:
-      return parse_while(p);
-// clang-format off
-#if 0
-    case TOK_FOR: return parse_for(p);
-    case TOK_BREAK: pnext1(p); return JS_SUCCESS;
-    case TOK_CONTINUE: pnext1(p); return JS_SUCCESS;
-#endif
-    case TOK_IF: return parse_if(p);
-    case TOK_CASE: case TOK_CATCH: case TOK_DELETE: case TOK_DO:
-    case TOK_INSTANCEOF: case TOK_NEW: case TOK_SWITCH: case TOK_THROW:
-    case TOK_TRY: case TOK_VAR: case TOK_VOID: case TOK_WITH:
-      // clang-format on
-      return vm_err(p->vm, "[%.*s] not implemented", p->tok.len, p->tok.ptr);
-    default: {
-      jsval_t res = JS_TRUE;
-      for (;;) {
-        TRY(parse_expr(p));
-        if (p->tok.tok != ',') break;
-        pnext(p);
-      }
-      return res;
-    }
+// Bytecode past the mark can be released, unless it holds functions that
+// are still referenced by props, the data stack, host roots or array
+// elements. Return the new bytecode pool length
+static ind_t code_watermark(struct elk *vm, ind_t mark) {
+  ind_t i, end = mark;
+  for (i = 0; i < vm->lim.props; i++) {
+    if (vm->props[i].flags != 0) fn_watermark(vm, vm->props[i].val, mark, &end);
   }
-}
-
-static jsval_t parse_statement_list(struct parser *p, jstok_t endtok) {
-  jsval_t res = JS_TRUE;
-  pnext(p);
-  DEBUG(("%s: tok %c endtok %c\n", __func__, p->tok.tok, endtok));
-  // printf(" ---> [%s]\n", p->tok.ptr);
-  while (res != JS_ERROR && p->tok.tok != TOK_EOF && p->tok.tok != endtok) {
-    if (!p->noexec && p->vm->sp > 0) vm_drop(p->vm);
-    res = parse_statement(p);
-#if 0
-    if (!p->noexec && p->vm->sp > 1 && 0) {
-      vm_swap(p->vm);
-      vm_drop(p->vm);
+  for (i = 0; i < vm->sp; i++) fn_watermark(vm, vm->data_stack[i], mark, &end);
+  for (i = 0; i < vm->nroots; i++) fn_watermark(vm, *vm->roots[i], mark, &end);
+  for (i = 0; i < vm->elems_len;
+       i = (ind_t)(i + ARR_HDR + vm->elems[i + ARR_CAP])) {
+    ind_t j;
+    if ((ind_t) vm->elems[i + ARR_OBJ] == INVALID_INDEX) continue;
+    for (j = 0; j < vm->elems[i + ARR_LEN]; j++) {
+      fn_watermark(vm, vm->elems[i + ARR_HDR + j], mark, &end);
     }
-#endif
-    while (p->tok.tok == ';') pnext(p);
   }
-  if (!p->noexec && p->vm->sp == 0) vm_push(p->vm, JS_UNDEFINED);
-  return res;
-}
-
-/////////////////////////////// EXTERNAL API /////////////////////////////////
-
-struct elk *js_create(void) {
-  struct elk *vm = (struct elk *) calloc(1, sizeof(*vm));
-  vm->objs[0].flags = OBJ_ALLOCATED;
-  vm->objs[0].props = INVALID_INDEX;
-  vm->call_stack[0] = MK_VAL(JS_TYPE_OBJECT, 0);
-  vm->csp++;
-  DEBUG(("%s: size %d bytes\n", __func__, (int) sizeof(*vm)));
-  return vm;
-};
-
-void js_destroy(struct elk *vm) {
-  free(vm);
+  return end;
 }
 
 jsval_t js_eval(struct elk *vm, const char *buf, int len) {
-  struct parser p = mk_parser(vm, buf, len > 0 ? len : (int) strlen(buf));
-  jsval_t v = JS_ERROR;
+  ind_t mark = vm->code_len;
+  jsval_t v;
   vm->error_message[0] = '\0';
-  if (parse_statement_list(&p, TOK_EOF) != JS_ERROR && vm->sp == 1) {
-    v = *vm_top(vm);
-  } else if (vm->error_message[0] == '\0') {
-    v = vm_err(vm, "stack %d", vm->sp);
+  v = js_compile(vm, buf, len);
+  if (v != JS_ERROR) v = js_run(vm, v);
+  // Garbage may hold functions defined by this code. Collect it first,
+  // keeping the result on the data stack so that it survives
+  if (code_watermark(vm, mark) > mark && vm->sp < vm->lim.data_stack) {
+    vm->data_stack[vm->sp++] = v;
+    js_gc(vm);
+    v = vm->data_stack[--vm->sp];  // String results may have moved
   }
+  vm->code_len = code_watermark(vm, mark);
   vm_dump(vm);
   DEBUG(("%s: %s\n", __func__, tostr(vm, v)));
   return v;
 }
 
-static void addcfn(struct elk *vm, jsval_t obj, struct cfunc *cf) {
-  cf->next = vm->cfuncs;  // Link to the list
-  vm->cfuncs = cf;        // of all ffi-ed functions
-  cf->id = vm->cfunc_count++;  // Assign a unique ID
-  js_set(vm, obj, js_mk_str(vm, cf->name, -1),
-         MK_VAL(JS_TYPE_C_FUNCTION, cf->id));  // Add to the object
+// Import n C functions from a binding table into object obj, which is
+// usually js_get_global(). Every VM gets its own function IDs, and parses
+// the declarations once, so many VMs can import the same table. Importing
+// a binding again reuses its ID
+jsval_t js_import(struct elk *vm, jsval_t obj, const struct cfunc *tab,
+                  int n) {
+  jsval_t res = JS_TRUE;
+  int i;
+  for (i = 0; i < n && res != JS_ERROR; i++) {
+    const struct cfunc *cf = &tab[i];
+    ind_t id = 0;
+    while (id < vm->ncfuncs && vm->cfuncs[id].cf != cf) id++;
+    if (id >= vm->lim.cfuncs) return vm_err(vm, "cfunc OOM");
+    if (id == vm->ncfuncs) ffi_prepare(&vm->cfuncs[vm->ncfuncs++], cf);
+    res = js_set(vm, obj, mk_key(vm, cf->name, (jslen_t) strlen(cf->name)),
+                 MK_VAL(JS_TYPE_C_FUNCTION, id));
+  }
+  return res;
 }
 
-#define js_ffi(vm, fn, decl)                                  \
-  do {                                                        \
-    static struct cfunc x = {#fn, decl, (cfn_t) fn, 0, NULL}; \
-    addcfn((vm), js_get_global(vm), &x);                      \
+// Binding table entry:
+// static const struct cfunc tab[] = {JS_CFUNC(f, "vi"), ...};
+#define JS_CFUNC(fn, decl) \
+  { #fn, decl, (cfn_t) fn }
+
+#define js_ffi(vm, fn, decl)                               \
+  do {                                                     \
+    static const struct cfunc x = JS_CFUNC(fn, decl);      \
+    js_import((vm), js_get_global(vm), &x, 1);             \
   } while (0)
 
 #endif  // JS_H
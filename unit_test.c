@@ -36,11 +36,11 @@
 
 static int g_num_checks;
 
-static bool check_num(struct elk *vm, jsval_t v, float expected) {
+static bool check_num(struct elk *vm, jsval_t v, jsnum_t expected) {
   // printf("%s: %g %g\n", __func__, tof(v), expected);
   if (js_type(v) == JS_TYPE_ERROR) printf("ERROR: %s\n", vm->error_message);
   return js_type(v) == JS_TYPE_NUMBER &&
-         fabs(js_to_float(v) - expected) < 0.0001;
+         fabs((double) js_to_float(v) - expected) < 0.0001;
 }
 
 static int check_str(struct elk *vm, jsval_t v, const char *expected) {
@@ -50,7 +50,7 @@ static int check_str(struct elk *vm, jsval_t v, const char *expected) {
          memcmp(p, expected, len) == 0;
 }
 
-static bool numexpr(struct elk *vm, const char *code, float expected) {
+static bool numexpr(struct elk *vm, const char *code, jsnum_t expected) {
   return check_num(vm, js_eval(vm, code, strlen(code)), expected);
 }
 
@@ -76,13 +76,23 @@ static const char *test_expr(void) {
 
   ASSERT(numexpr(vm, "let aq = 1;", 1.0f));
   ASSERT(numexpr(vm, "let aw = 1, be = 2;", 2.0f));
+  ASSERT(numexpr(vm, "aw = be = 7; aw + be", 14));
+  ASSERT(strexpr(vm, "aw = 'x'", "x"));
+  ASSERT(js_eval(vm, "nosuchvar = 1", -1) == JS_ERROR);
   ASSERT(numexpr(vm, "123", 123.0f));
   ASSERT(numexpr(vm, "123;", 123.0f));
   ASSERT(numexpr(vm, "{123}", 123.0f));
+#ifdef JS_NUM_INT32
+  ASSERT(numexpr(vm, "1 + 2 * 3.7 - 7 % 3", 6));
+  ASSERT(numexpr(vm, "let ag = 1.23, bg = 5.3;", 5));
+  ASSERT(numexpr(vm, "ag;", 1));
+  ASSERT(numexpr(vm, "ag - 2 * 3.1;", -5));
+#else
   ASSERT(numexpr(vm, "1 + 2 * 3.7 - 7 % 3", 7.4f));
   ASSERT(numexpr(vm, "let ag = 1.23, bg = 5.3;", 5.3f));
   ASSERT(numexpr(vm, "ag;", 1.23f));
   ASSERT(numexpr(vm, "ag - 2 * 3.1;", -4.97f));
+#endif
   ASSERT(numexpr(vm,
                  "let az = 1.23; az + 1; let fz = function(a) "
                  "{ return az + 1; }; 1;",
@@ -104,9 +114,16 @@ static const char *test_expr(void) {
   ASSERT(strexpr(vm, "typeof(bx)", "function"));
 
   ASSERT(numexpr(vm, "0x64", 100));
+#ifdef JS_NUM_INT32
+  ASSERT(numexpr(vm, "0x7f7fffff", 0x7f7fffff));
+  ASSERT(numexpr(vm, "0x7fffffff", 0x7f7fffff));  // Saturated
+  ASSERT(numexpr(vm, "0xffffffff", 0x7f7fffff));
+  ASSERT(numexpr(vm, "123.4", 123));
+#else
   ASSERT(numexpr(vm, "0x7fffffff", 0x7fffffff));
   ASSERT(numexpr(vm, "0xffffffff", 0xffffffff));
   ASSERT(numexpr(vm, "123.4", 123.4));
+#endif
   ASSERT(numexpr(vm, "200+50", 250));
   ASSERT(numexpr(vm, "1-2*3", -5));
   ASSERT(numexpr(vm, "1-2+3", 2));
@@ -126,9 +143,17 @@ static const char *test_expr(void) {
   ASSERT(numexpr(vm, "6 & 3", 2));
   ASSERT(numexpr(vm, "6 | 3", 7));
   ASSERT(numexpr(vm, "6 ^ 3", 5));
-
+  ASSERT(numexpr(vm, "10 - 4 - 3 - 2", 1));
+  ASSERT(numexpr(vm, "2 * 3 + 4 * 5 - 6 / 2", 23));
+  ASSERT(numexpr(vm, "1 + 2 << 1 + 1", 12));
+  ASSERT(numexpr(vm, "1 | 6 & 3 ^ 8", 11));
+  ASSERT(numexpr(vm, "-2 * -(1 + 2) % 4", 2));
+  ASSERT(numexpr(vm, "~1 + 3 * ~~2", 4));
+
+#ifndef JS_NUM_INT32
   ASSERT(numexpr(vm, "0.1 + 0.2", 0.3));
   ASSERT(numexpr(vm, "123.4 + 0.1", 123.5));
+#endif
 
   // printf("--> %s\n", js_stringify(vm, js_eval(vm, "~10", -1)));
   ASSERT(numexpr(vm, "{let a = 200; a += 50; a}", 250));
@@ -158,6 +183,42 @@ static const char *test_expr(void) {
   CHECK_NUMERIC("false ? 4 : '' ? 6 : 7;", 7);
   CHECK_NUMERIC("77 ? 4 : '' ? 6 : 7;", 4);
 
+  // Comparisons, and short-circuit logical operators
+  ASSERT(js_eval(vm, "1 === 1", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "1 !== 1", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "1 === '1'", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "'ab' + 'c' === 'abc'", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "null === undefined", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "let cmpo = {}; cmpo === cmpo", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "cmpo === {}", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "1 < 2", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "2 <= 2", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "1 > 2", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "1 >= 2", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "1 + 2 < 2 * 2", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "'ab' < 'abc'", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "'b' > 'abc'", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "1 < 'a'", -1) == JS_ERROR);
+  ASSERT(js_eval(vm, "1 == 1", -1) == JS_ERROR);
+#ifndef JS_NUM_INT32
+  ASSERT(js_eval(vm, "1.5 + 1.5 === 3", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "0 / 0 === 0 / 0", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "0 / 0 !== 0 / 0", -1) == JS_TRUE);
+  ASSERT(js_eval(vm, "0 / 0 <= 1", -1) == JS_FALSE);
+  ASSERT(js_eval(vm, "0 === -0", -1) == JS_TRUE);
+#endif
+  CHECK_NUMERIC("0 && undefined_var", 0);
+  CHECK_NUMERIC("1 && 2", 2);
+  CHECK_NUMERIC("3 || undefined_var", 3);
+  CHECK_NUMERIC("0 || '' || 4", 4);
+  CHECK_NUMERIC("1 < 2 && 3 > 2 ? 5 : 6", 5);
+  ASSERT(js_eval(vm, "1 || 2 = 3", -1) == JS_ERROR);
+
+  // Prefix increment and decrement return the new value
+  CHECK_NUMERIC("let pq = 1; ++pq", 2);
+  CHECK_NUMERIC("--pq + pq", 2);
+  CHECK_NUMERIC("let pa = [5]; ++pa[0] + pa[0]", 12);
+
   // TODO
   // CHECK_NUMERIC("1, 2;", 2);
 
@@ -212,18 +273,23 @@ static const char *test_strings(void) {
   ASSERT(strexpr(vm, "'a'", "a"));
   ASSERT(vm->stringbuf_len == 3);
   ASSERT(strexpr(vm, "'b'", "b"));
+  js_gc(vm);
   ASSERT(vm->stringbuf_len == 3);
   ASSERT(numexpr(vm, "1", 1.0f));
+  js_gc(vm);
   ASSERT(vm->stringbuf_len == 0);
   ASSERT(numexpr(vm, "{let a = 1;}", 1.0f));
+  js_gc(vm);
   ASSERT(vm->stringbuf_len == 0);
   ASSERT(numexpr(vm, "{let a = 'abc';} 1;", 1.0f));
+  js_gc(vm);
   ASSERT(vm->stringbuf_len == 0);
   ASSERT(strexpr(vm, "'a' + 'b'", "ab"));
   ASSERT(strexpr(vm, "'vb'", "vb"));
 
   // Make sure strings are GC-ed
   CHECK_NUMERIC("1;", 1);
+  js_gc(vm);
   ASSERT(vm->stringbuf_len == 0);
 
   ASSERT(strexpr(vm, "let a, b = function(x){}, c = 'aa'", "aa"));
@@ -236,6 +302,105 @@ static const char *test_strings(void) {
   return NULL;
 }
 
+static const char *test_rope(void) {
+  struct elk *vm = js_create();
+  jsval_t g = js_get_global(vm);
+  ind_t len;
+  js_ffi(vm, strlen, "is");
+
+  // Short appends are copied into a tail leaf, rather than a node each
+  ASSERT(js_eval(vm, "let t = 'x', i = 60; while (i) { t = t + 'yy'; i--; }",
+                 -1) != JS_ERROR);
+  ASSERT(numexpr(vm, "t.length", 121));
+  ASSERT(strexpr(vm, "t[120]", "y"));
+  ASSERT(js_eval(vm, "t = ''", -1) != JS_ERROR);
+  js_gc(vm);
+
+  // And so are short prepends, into a head leaf
+  ASSERT(js_eval(vm, "t = 'x'; i = 60; while (i) { t = 'yy' + t; i--; }",
+                 -1) != JS_ERROR);
+  ASSERT(numexpr(vm, "t.length", 121));
+  ASSERT(strexpr(vm, "t[120]", "x"));
+  ASSERT(js_eval(vm, "t = ''", -1) != JS_ERROR);
+  js_gc(vm);
+
+  // Appends make rope nodes, and length does not flatten them
+  ASSERT(js_eval(vm, "let s = ''; i = 12; while (i) { s += 'abcd'; i--; }",
+                 -1) != JS_ERROR);
+  len = vm->stringbuf_len;
+  ASSERT(numexpr(vm, "s.length", 48));
+  ASSERT(vm->stringbuf_len == len);
+  ASSERT(strexpr(vm, "s[45]", "b"));
+  len = vm->stringbuf_len;
+  ASSERT(strexpr(vm, "s[0]", "a"));
+  ASSERT(vm->stringbuf_len == len + 3);  // Flattened only once
+  ASSERT(numexpr(vm, "strlen(s)", 48));
+  ASSERT(strexpr(vm, "s + ''",
+                 "abcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcd"));
+  ASSERT(js_eval(vm, "s += 1", -1) == JS_ERROR);
+
+  // Ropes and their halves survive compaction, and shared halves are fine
+  ASSERT(js_eval(vm, "let r = '', p = '', d = s; i = 6;"
+                 "while (i) { 'junk'; r += 'abc' + 'de'; p = 'xyz' + p; i--; }"
+                 "d += d; d += d;", -1) != JS_ERROR);
+  js_gc(vm);
+  ASSERT(strexpr(vm, "r", "abcdeabcdeabcdeabcdeabcdeabcde"));
+  ASSERT(strexpr(vm, "p", "xyzxyzxyzxyzxyzxyz"));
+  ASSERT(numexpr(vm, "d.length", 192));
+  ASSERT(strexpr(vm, "d[191]", "d"));
+  ASSERT(numexpr(vm, "(d + d).length", 384));
+
+  // Host keys are flattened
+  ASSERT(js_set(vm, g, js_eval(vm, "'abcdefghij' + 'klmnopqrst'", -1),
+                js_mk_num(1)) == JS_TRUE);
+  ASSERT(numexpr(vm, "abcdefghijklmnopqrst", 1));
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_long_strings(void) {
+  struct js_limits lim = {10, 10, 20, 30, 4096, 4096, 0, 16, 0, 4};
+  static union js_align slab[4096];
+  char big[1000], code[1200];
+  struct elk *vm;
+  jsval_t g;
+  const char *p;
+  jslen_t len;
+  int i;
+  ASSERT(js_size(&lim) <= sizeof(slab));
+  vm = js_create_in(slab, sizeof(slab), &lim);
+  g = js_get_global(vm);
+  for (i = 0; i < (int) sizeof(big) - 1; i++) big[i] = (char) ('a' + i % 26);
+  big[sizeof(big) - 1] = '\0';
+
+  // Literals, and host strings longer than 255 bytes
+  snprintf(code, sizeof(code), "let s = '%s'; s.length", big);
+  ASSERT(numexpr(vm, code, 999));
+  ASSERT(strexpr(vm, "s[998]", "k"));
+  js_mk_str(vm, "junk", 4);
+  ASSERT(js_set(vm, g, js_mk_str(vm, "t", 1), js_mk_str(vm, big, 300)) ==
+         JS_TRUE);
+  js_mk_str(vm, "junk", 4);
+  js_gc(vm);
+  ASSERT(numexpr(vm, "t.length + s.length", 1299));
+  p = js_to_str(vm, js_eval(vm, "t", -1), &len);
+  ASSERT(len == 300 && memcmp(p, big, len) == 0);
+  ASSERT(numexpr(vm, "let u = s + t + 'x'; u.length", 1300));
+  ASSERT(strexpr(vm, "u[1299]", "x"));
+  ASSERT(strexpr(vm, "u[1000]", "b"));
+  ASSERT(js_mk_str(vm, NULL, 70000) == JS_ERROR);
+
+  // Function bodies longer than 255 bytes
+  snprintf(code, sizeof(code),
+           "let f = function(x) { let y = '%.300s'; return y.length + x; };"
+           "f(1)", big);
+  ASSERT(numexpr(vm, code, 301));
+  js_to_str(vm, js_eval(vm, "f", -1), &len);
+  ASSERT(len > 300);
+  js_destroy(vm);
+  return NULL;
+}
+
 static const char *test_scopes(void) {
   struct elk *vm = js_create();
   ASSERT(numexpr(vm, "1.23", 1.23f));
@@ -244,6 +409,7 @@ static const char *test_scopes(void) {
   ASSERT(!(vm->objs[1].flags & OBJ_ALLOCATED));
   ASSERT(!(vm->props[0].flags & PROP_ALLOCATED));
   ASSERT(numexpr(vm, "{let a = 1.23;}", 1.23f));
+  js_gc(vm);
   ASSERT(!(vm->objs[1].flags & OBJ_ALLOCATED));
   ASSERT(!(vm->props[0].flags & PROP_ALLOCATED));
   CHECK_NUMERIC("if (1) 2", 2);
@@ -265,6 +431,10 @@ static const char *test_if(void) {
   ASSERT(js_eval(vm, "null", -1) == JS_NULL);
   ASSERT(js_eval(vm, "undefined", -1) == JS_UNDEFINED);
   CHECK_NUMERIC("if (1) {2;}", 2);
+  // Untaken branches are jumped over, not executed
+  ASSERT(js_eval(vm, "if (0) { nosuchfunc(1, {a: 2}); { 3; } }", -1) ==
+         JS_UNDEFINED);
+  CHECK_NUMERIC("let i = 0; while (i) { nosuchfunc(); } 4", 4);
   js_destroy(vm);
   return NULL;
 }
@@ -294,6 +464,7 @@ static const char *test_function(void) {
   js_eval(vm, "let f7 = function(s){return s.length;};", -1);
   len = vm->stringbuf_len;
   CHECK_NUMERIC("f7('abc')", 3);
+  js_gc(vm);
   ASSERT(vm->stringbuf_len == len);
 
   // Test that the function's function args get garbage collected
@@ -306,6 +477,41 @@ static const char *test_function(void) {
   return NULL;
 }
 
+static const char *test_frames(void) {
+  struct elk *vm = js_create();
+  ind_t nobjs, len;
+  ASSERT(js_eval(vm, "let f = function(a, b) { a += b; b++; return a * b; };",
+                 -1) != JS_ERROR);
+  CHECK_NUMERIC("f(2, 3)", 20);
+  CHECK_NUMERIC("f(2, 3, 4, 5)", 20);  // Extra args are dropped
+  ASSERT(js_eval(vm, "let g = function(a, b) { return typeof b; };", -1) !=
+         JS_ERROR);
+  ASSERT(strexpr(vm, "g(1)", "undefined"));
+
+  // Locals, and a parameter shadowed in a block
+  ASSERT(js_eval(vm, "let h = function(a) { let x = a * 2; "
+                     "{ let a = 10; x += a; } return x + a; };",
+                 -1) != JS_ERROR);
+  CHECK_NUMERIC("h(1)", 13);
+  ASSERT(js_eval(vm, "let e = function(a) { let a = 1; }; e(2)", -1) ==
+         JS_ERROR);
+
+  // Inner functions see the caller's parameters by name
+  ASSERT(js_eval(vm, "let inner = function() { y--; return y; };"
+                     "let outer = function(y) { return inner() + y; };",
+                 -1) != JS_ERROR);
+  CHECK_NUMERIC("outer(5)", 8);
+
+  // Calls do not allocate scopes, nor copy parameter names
+  ASSERT(js_eval(vm, "let n = 20, s = 0;", -1) != JS_ERROR);
+  nobjs = vm->nobjs;
+  len = vm->stringbuf_len;
+  CHECK_NUMERIC("while (n) s += f(n--, 1); s", 460);
+  ASSERT(vm->nobjs == nobjs && vm->stringbuf_len == len);
+  js_destroy(vm);
+  return NULL;
+}
+
 static const char *test_objects(void) {
   struct elk *vm = js_create();
   ASSERT(typeexpr(vm, "let o = {}; o", JS_TYPE_OBJECT));
@@ -352,6 +558,10 @@ static bool fb(void) {
   return true;
 }
 
+static double scale(int n, float k, bool neg) {
+  return neg ? -n * k : n * k;
+}
+
 struct foo {
   int n;
   unsigned char x;
@@ -431,6 +641,19 @@ static const char *test_ffi(void) {
   ASSERT(js_eval(vm, "fbiiiii(1,1,1,1,1);", -1) == JS_TRUE);
   ASSERT(js_eval(vm, "fbiiiii(1,-1,1,-1,0);", -1) == JS_FALSE);
 
+#ifdef JS_NUM_INT32
+  // No float math: floats and doubles cannot be passed or returned
+  js_ffi(vm, fbd, "bd");
+  ASSERT(js_eval(vm, "fbd(4);", -1) == JS_ERROR);
+  js_ffi(vm, pi, "f");
+  ASSERT(js_eval(vm, "pi();", -1) == JS_ERROR);
+  js_ffi(vm, mul, "ddd");
+  ASSERT(js_eval(vm, "mul(1, 2)", -1) == JS_ERROR);
+  js_ffi(vm, sub, "fff");
+  ASSERT(js_eval(vm, "sub(1, 2)", -1) == JS_ERROR);
+  js_ffi(vm, fmt, "ssf");
+  ASSERT(js_eval(vm, "fmt('%d', 1)", -1) == JS_ERROR);
+#else
   js_ffi(vm, fbd, "bd");
   ASSERT(js_eval(vm, "fbd(3.15);", -1) == JS_TRUE);
   ASSERT(js_eval(vm, "fbd(3.13);", -1) == JS_FALSE);
@@ -450,6 +673,8 @@ static const char *test_ffi(void) {
   js_ffi(vm, mul, "ddd");
   ASSERT(numexpr(vm, "mul(1.323, 7.321)", 9.685683f));
 
+#endif
+
   js_ffi(vm, callcb, "i[iiiu]u");
   ASSERT(numexpr(vm, "callcb(function(a,b,c){return a+b;}, 123);", 5));
 
@@ -460,6 +685,260 @@ static const char *test_ffi(void) {
   return NULL;
 }
 
+static unsigned char s_dev[64] = {7, 8, 9, 10};
+
+static void *devptr(int offset) {  // Returns NULL for a negative offset
+  return offset < 0 ? NULL : s_dev + offset;
+}
+
+static int devbyte(const unsigned char *p, int offset) {
+  return p[offset];
+}
+
+static const char *test_pointer(void) {
+  struct elk *vm = js_create();
+  ind_t len;
+  js_ffi(vm, devptr, "pi");
+  js_ffi(vm, devbyte, "ipi");
+  ASSERT(typeexpr(vm, "devptr(0)", JS_TYPE_POINTER));
+  ASSERT(strexpr(vm, "typeof(devptr(0))", "pointer"));
+  ASSERT(js_eval(vm, "devptr(0 - 1)", -1) == JS_NULL);
+  ASSERT(js_eval(vm, "devptr(1)", -1) == js_eval(vm, "devptr(1)", -1));
+  ASSERT(js_to_ptr(vm, js_eval(vm, "devptr(2)", -1)) == s_dev + 2);
+  ASSERT(js_to_ptr(vm, js_mk_ptr(vm, s_dev)) == s_dev);
+  ASSERT(js_mk_ptr(vm, NULL) == JS_NULL);
+
+  // Pointers do not take space in the string pool
+  js_eval(vm, "let d = devptr(0);", -1);
+  len = vm->stringbuf_len;
+  ASSERT(numexpr(vm, "devbyte(d, 2)", 9));
+  ASSERT(numexpr(vm, "d[3]", 10));
+  ASSERT(vm->stringbuf_len == len);
+
+  // Handles are collected when unreachable
+  ASSERT(numexpr(vm,
+                 "let n = 40, s = 0;"
+                 "while (n) s += devbyte(devptr(n--), 0); s",
+                 27));
+  js_gc(vm);
+#ifdef JS_VAL64
+  ASSERT(vm->nhandles == 0);  // Pointers are in the values
+
+  // Live pointers are not limited by the handle table
+  ASSERT(numexpr(vm,
+                 "let ps = [], k = 40;"
+                 "while (k) ps.push(devptr(k--)); devbyte(ps[39], 0)",
+                 8));
+  ASSERT(numexpr(vm, "devbyte(ps[37], 0)", 10));
+#else
+  ASSERT(vm->nhandles == 1);
+#endif
+  ASSERT(numexpr(vm, "devbyte(d, 0)", 7));
+
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_buffer(void) {
+  struct elk *vm = js_create();
+  unsigned char frame[8] = {1, 2, 0xff, 0xfe, 0x34, 0x12, 0, 0};
+  short words[3] = {-1, 300, 7};
+  float floats[2] = {1.5f, -2.25f};
+  jsval_t g = js_get_global(vm);
+  ind_t len;
+
+  js_set(vm, g, js_mk_str(vm, "f", 1), js_mk_buf(vm, frame, 8, JS_BUF_U8));
+  js_set(vm, g, js_mk_str(vm, "s", 1), js_mk_buf(vm, frame, 8, JS_BUF_I8));
+  js_set(vm, g, js_mk_str(vm, "h", 1), js_mk_buf(vm, frame, 4, JS_BUF_U16));
+  js_set(vm, g, js_mk_str(vm, "w", 1), js_mk_buf(vm, words, 3, JS_BUF_I16));
+#ifdef JS_NUM_INT32
+  ASSERT(js_mk_buf(vm, floats, 2, JS_BUF_F32) == JS_ERROR);  // No float math
+#else
+  js_set(vm, g, js_mk_str(vm, "x", 1), js_mk_buf(vm, floats, 2, JS_BUF_F32));
+#endif
+  ASSERT(js_mk_buf(vm, frame, 1, 0) == JS_ERROR);
+  ASSERT(js_mk_buf(vm, frame, -1, JS_BUF_U8) == JS_ERROR);
+
+  // Reads and writes go straight to host memory
+  js_eval(vm, "let i = 8, sum = 0;", -1);
+  len = vm->stringbuf_len;
+  ASSERT(numexpr(vm, "f.length", 8));
+  ASSERT(numexpr(vm, "f[0] + f[1] + f[2]", 258));
+  ASSERT(numexpr(vm, "s[2] + s[3]", -3));
+  ASSERT(numexpr(vm, "h[2]", 0x1234));
+  ASSERT(numexpr(vm, "w[0] + w[1] + w[2]", 306));
+#ifndef JS_NUM_INT32
+  ASSERT(numexpr(vm, "x[0] + x[1]", -0.75));
+#endif
+  ASSERT(js_eval(vm, "f[8]", -1) == JS_UNDEFINED);
+  ASSERT(numexpr(vm, "f[6] = 0x1ff", 0x1ff));
+  ASSERT(numexpr(vm, "f[7] += 3", 3));
+  ASSERT(numexpr(vm, "f[7]++", 3));
+  ASSERT(numexpr(vm, "w[1] -= 301", -1));
+  ASSERT(numexpr(vm, "f[100] = 5", 5));
+  ASSERT(frame[6] == 0xff && frame[7] == 4);
+  ASSERT(words[1] == -1);
+#ifndef JS_NUM_INT32
+  ASSERT(numexpr(vm, "x[1] = 1", 1));
+  ASSERT(floats[1] == 1.0f);
+#endif
+  ASSERT(numexpr(vm, "while (i) sum += f[i -= 1]; sum", 841));
+  ASSERT(vm->stringbuf_len == len);
+  ASSERT(js_eval(vm, "f[0] = 'a'", -1) == JS_ERROR);
+  ASSERT(js_eval(vm, "'abc'[0] = 1", -1) == JS_ERROR);
+
+  // Buffers in the VM string pool survive compaction
+  js_eval(vm, "let junk = 'a' + 'b';", -1);
+  js_set(vm, g, js_mk_str(vm, "v", 1), js_mk_buf(vm, NULL, 4, JS_BUF_U32));
+  ASSERT(numexpr(vm, "v[0] + v[3]", 0));
+  ASSERT(numexpr(vm, "v[3] = 0x12345678", 0x12345678));
+  js_eval(vm, "junk = 0;", -1);
+  js_gc(vm);
+  ASSERT(numexpr(vm, "v[3]", 0x12345678));
+  ASSERT(js_to_ptr(vm, js_eval(vm, "v", -1)) != NULL);
+
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_array(void) {
+  struct elk *vm = js_create();
+  ind_t len;
+  ASSERT(js_eval(vm, "let a = [1, 2, 'x'], b = [], i = 0;", -1) != JS_ERROR);
+  ASSERT(strexpr(vm, "typeof(a)", "object"));
+  ASSERT(strcmp(js_stringify(vm, js_eval(vm, "a", -1)), "[1,2,\"x\"]") == 0);
+  ASSERT(numexpr(vm, "a.length", 3));
+  ASSERT(numexpr(vm, "a[0] + a[1]", 3));
+  ASSERT(strexpr(vm, "a[2]", "x"));
+  ASSERT(js_eval(vm, "a[3]", -1) == JS_UNDEFINED);
+  ASSERT(js_eval(vm, "a.foo", -1) == JS_UNDEFINED);
+  ASSERT(numexpr(vm, "a[1] += 5", 7));
+  ASSERT(numexpr(vm, "a[0]++", 1));
+  ASSERT(numexpr(vm, "a[0]", 2));
+  ASSERT(numexpr(vm, "b.length", 0));
+  ASSERT(numexpr(vm, "let t = [], r = 0; while (t) { r = 4; t = 0; } r", 4));
+
+  // Stores past the end grow the array, push() appends
+  ASSERT(numexpr(vm, "b[2] = 5", 5));
+  ASSERT(js_eval(vm, "b[0]", -1) == JS_UNDEFINED);
+  ASSERT(numexpr(vm, "b.length", 3));
+  ASSERT(numexpr(vm, "b.push(6, 7)", 5));
+  ASSERT(numexpr(vm, "b[b.length] = 8; b.length", 6));
+  ASSERT(numexpr(vm, "while (i - 10) a.push(i += 1); a.length", 13));
+  ASSERT(numexpr(vm, "a[12] + b[4]", 17));
+  ASSERT(js_eval(vm, "a[-1] = 1", -1) == JS_ERROR);
+  ASSERT(strcmp(vm->error_message, "bad index") == 0);
+  ASSERT(js_eval(vm, "a[1000] = 1", -1) == JS_ERROR);
+  ASSERT(strcmp(vm->error_message, "array OOM") == 0);
+  ASSERT(numexpr(vm, "[[1, 2], [3]][0][1]", 2));
+
+  // GC frees unreachable arrays and compacts the elements pool
+  ASSERT(js_eval(vm, "a = 0; b = ['s' + 't', 'u'];", -1) != JS_ERROR);
+  js_gc(vm);
+  len = vm->elems_len;
+  ASSERT(len < 16);
+  ASSERT(strexpr(vm, "b[0] + b[1]", "stu"));
+  ASSERT(numexpr(vm, "b.push(1, 2, 3, 4, 5)", 7));
+  ASSERT(vm->elems_len > len);
+  js_destroy(vm);
+  return NULL;
+}
+
+static const struct cfunc s_bindings[] = {
+    JS_CFUNC(scale, "difb"),
+    JS_CFUNC(strlen, "is"),
+    JS_CFUNC(mul, "dfd"),
+    JS_CFUNC(fbiiiii, "biiiiiii"),
+};
+
+static const char *test_import(void) {
+  struct elk *vm = js_create(), *vm2 = js_create();
+  int i;
+  ASSERT(js_import(vm, js_get_global(vm), s_bindings, 2) == JS_TRUE);
+  ASSERT(js_import(vm2, js_get_global(vm2), s_bindings + 1, 3) == JS_TRUE);
+  ASSERT(vm->ncfuncs == 2 && vm2->ncfuncs == 3);
+#ifdef JS_NUM_INT32
+  ASSERT(js_eval(vm, "scale(3, 2, true)", -1) == JS_ERROR);  // No float math
+#else
+  ASSERT(numexpr(vm, "scale(3, 2, true)", -6));
+  ASSERT(numexpr(vm, "scale(3, 2, false)", 6));
+#endif
+  ASSERT(numexpr(vm, "strlen('abc')", 3));
+  ASSERT(numexpr(vm2, "strlen('abcd')", 4));
+  ASSERT(js_eval(vm2, "scale(3, 2, true)", -1) == JS_ERROR);
+
+  // Bad declarations are rejected when called
+  ASSERT(js_eval(vm2, "mul(1, 2)", -1) == JS_ERROR);
+  ASSERT(js_eval(vm2, "fbiiiii(1,1,1,1,1,1,1)", -1) == JS_ERROR);
+  ASSERT(js_eval(vm2, "strlen('abc', 1)", -1) == JS_ERROR);
+
+  // Importing again reuses IDs, until the registry is full
+  for (i = 0; i < JS_CFUNC_SIZE; i++) {
+    ASSERT(js_import(vm, js_get_global(vm), s_bindings, 2) == JS_TRUE);
+  }
+  ASSERT(vm->ncfuncs == 2);
+  vm->ncfuncs = JS_CFUNC_SIZE;
+  ASSERT(js_import(vm, js_get_global(vm), s_bindings + 2, 1) == JS_ERROR);
+  ASSERT(numexpr(vm, "strlen('ab')", 2));
+
+  js_destroy(vm);
+  js_destroy(vm2);
+
+  // The registry size is a VM limit
+  {
+    static struct cfunc many[300];
+    static union js_align slab[4096];
+    struct js_limits lim = {10, 10, 20, 30, 256, 256, 0, 8, 300, 4};
+    ASSERT(js_size(&lim) <= sizeof(slab));
+    vm = js_create_in(slab, sizeof(slab), &lim);
+    ASSERT(vm != NULL);
+    for (i = 0; i < 300; i++) many[i] = s_bindings[1];
+    ASSERT(js_import(vm, js_get_global(vm), many, 300) == JS_TRUE);
+    ASSERT(vm->ncfuncs == 300);
+    ASSERT(js_import(vm, js_get_global(vm), s_bindings, 1) == JS_ERROR);
+    ASSERT(numexpr(vm, "strlen('abc')", 3));
+    js_destroy(vm);
+  }
+  return NULL;
+}
+
+// Runs more code while the caller's operands are on stack
+static int nested(struct elk *vm, int x) {
+  return (int) js_to_float(js_eval(vm, "k + 4", -1)) + x;
+}
+
+static const char *test_call(void) {
+  struct elk *vm = js_create();
+  jsval_t f, argv[2];
+  ind_t sp;
+  f = js_eval(vm, "let f = function(a, b) { return a * 10 + b; }; f", -1);
+  ASSERT(js_type(f) == JS_TYPE_FUNCTION);
+  sp = vm->sp;
+  argv[0] = js_mk_num(4);
+  argv[1] = js_mk_num(2);
+  ASSERT(check_num(vm, js_call(vm, f, argv, 2), 42));
+  ASSERT(js_call(vm, f, argv, 1) == JS_ERROR);  // b is undefined
+  ASSERT(js_call(vm, js_mk_num(1), argv, 1) == JS_ERROR);
+  ASSERT(vm->sp == sp);
+
+  f = js_eval(vm, "let g = function(s) { return s + '!'; }; g", -1);
+  argv[0] = js_mk_str(vm, "hi", 2);
+  ASSERT(check_str(vm, js_call(vm, f, argv, 1), "hi!"));
+
+  js_ffi(vm, strlen, "is");
+  f = js_eval(vm, "strlen", -1);
+  ASSERT(js_type(f) == JS_TYPE_C_FUNCTION);
+  ASSERT(check_num(vm, js_call(vm, f, argv, 1), 2));
+  ASSERT(vm->sp == sp);
+
+  js_ffi(vm, nested, "imi");
+  ASSERT(numexpr(vm, "let k = 40; nested(0, 1)", 45));
+  ASSERT(numexpr(vm, "let h = function(a, b) { return nested(0, a) + b; }; h(1, 2)", 47));
+  ASSERT(numexpr(vm, "let id = function(x) { return x; }; k + id(nested(0, 0)) + k", 124));
+  js_destroy(vm);
+  return NULL;
+}
+
 static const char *test_subscript(void) {
   struct elk *vm = js_create();
   ASSERT(js_eval(vm, "123[0]", -1) == JS_ERROR);
@@ -491,7 +970,11 @@ static const char *test_stringify(void) {
   struct elk *vm = js_create();
   const char *expected;
   js_ffi(vm, tostr, "smj");
+#ifdef JS_NUM_INT32
+  expected = "{\"a\":1,\"b\":3}";  // Fraction is dropped
+#else
   expected = "{\"a\":1,\"b\":3.14}";
+#endif
   ASSERT(strexpr(vm, "tostr(0,{a:1,b:3.14});", expected));
   expected = "{\"a\":true,\"b\":false}";
   ASSERT(strexpr(vm, "tostr(0,{a:true,b:false});", expected));
@@ -509,18 +992,464 @@ static const char *test_stringify(void) {
   return NULL;
 }
 
+static const char *test_compile(void) {
+  struct elk *vm = js_create();
+  jsval_t code;
+  ind_t len;
+  ASSERT(js_eval(vm, "let n = 0;", -1) != JS_ERROR);
+  code = js_compile(vm, "n += 2; n", -1);
+  ASSERT(js_type(code) == JS_TYPE_FUNCTION);
+  len = vm->code_len;
+  ASSERT(check_num(vm, js_run(vm, code), 2));
+  ASSERT(check_num(vm, js_run(vm, code), 4));
+  ASSERT(vm->code_len == len);
+  ASSERT(js_compile(vm, "1 +", -1) == JS_ERROR);
+  ASSERT(vm->code_len == len);
+
+  // Bytecode of evaluated code is released, unless it defines live functions
+  CHECK_NUMERIC("let i = 9; while (i) i--; 7", 7);
+  ASSERT(vm->code_len == len);
+  CHECK_NUMERIC("let f = function(x){ return x * 2; }; f(3)", 6);
+  ASSERT(vm->code_len > len);
+  len = vm->code_len;
+  CHECK_NUMERIC("f(f(1)) + (function(){ return 1; })()", 5);
+  ASSERT(vm->code_len == len);
+  ASSERT(strexpr(vm, "let o = {f: function(){}}; typeof(o.f)", "function"));
+  ASSERT(vm->code_len > len);
+  CHECK_NUMERIC("let a = [function(x){ return x + 1; }]; 0", 0);
+  CHECK_NUMERIC("a[0](41)", 42);
+  js_destroy(vm);
+  return NULL;
+}
+
+static jstok_t lex1(const char *s) {
+  struct parser p;
+  memset(&p, 0, sizeof(p));
+  p.buf = p.pos = s;
+  p.end = s + strlen(s);
+  return lex(&p);
+}
+
+static const char *test_tokens(void) {
+  struct elk *vm = js_create();
+  char buf[1200];
+  int i, n;
+  const char *idents[] = {"fo", "forx", "iff", "_if", "If", "$do",
+                          "le", "lets", "undefined_", NULL};
+  for (i = 0; i <= TOK_UNDEFINED - TOK_BREAK; i++) {
+    ASSERT(lex1(s_keywords[i]) == (jstok_t) TOK_BREAK + i);
+  }
+  for (i = 0; idents[i] != NULL; i++) ASSERT(lex1(idents[i]) == TOK_IDENT);
+  ASSERT(lex1(">>>=") == QT('>', '>', '>', '='));
+  ASSERT(lex1(">>>>") == TT('>', '>', '>'));
+  ASSERT(lex1(">>=") == TT('>', '>', '='));
+  ASSERT(lex1("<<=") == TT('<', '<', '='));
+  ASSERT(lex1("!==") == TT('!', '=', '='));
+  ASSERT(lex1("====") == TT('=', '=', '='));
+  ASSERT(lex1("<==") == DT('<', '='));
+  ASSERT(lex1("&&=") == DT('&', '&'));
+  ASSERT(lex1("=>") == '=');
+  ASSERT(lex1("?:") == '?');
+  ASSERT(lex1("#") == TOK_INVALID);
+  ASSERT(lex1("\xd1") == TOK_INVALID);
+
+  {  // Peek while lexing on the fly, and while walking pre-lexed tokens
+    struct parser p = mk_parser(vm, "f(a, 'b')", 9);
+    for (i = 0; i < 2; i++) {
+      if (i == 1) tokenize(&p);
+      ASSERT(pnext(&p) == TOK_IDENT);
+      ASSERT(lookahead(&p) == '(' && lookahead(&p) == '(');
+      ASSERT(p.tok.tok == TOK_IDENT && p.tok.len == 1 && p.tok.ptr[0] == 'f');
+      ASSERT(pnext(&p) == '(' && p.prev_tok == TOK_IDENT);
+      ASSERT(pnext(&p) == TOK_IDENT && lookahead(&p) == ',');
+      ASSERT(pnext(&p) == ',' && lookahead(&p) == TOK_STR);
+      ASSERT(pnext(&p) == TOK_STR && p.tok.len == 1 && p.tok.ptr[0] == 'b');
+      ASSERT(pnext(&p) == ')' && lookahead(&p) == TOK_EOF);
+      ASSERT(pnext(&p) == TOK_EOF && lookahead(&p) == TOK_EOF);
+      p = mk_parser(vm, "f(a, 'b')", 9);
+    }
+  }
+  // Long scripts: bytecode grows into the token array, lexing falls back
+  // to the source text midway, or the token array does not fit at all
+  for (n = 30; n <= 72; n += 7) {
+    strcpy(buf, "0");
+    for (i = 0; i < n; i++) strcat(buf, "+'a'.length");
+    ASSERT(check_num(vm, js_eval(vm, buf, -1), n));
+  }
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_prop_index(void) {
+  struct elk *vm = js_create();
+  char buf[20];
+  int i;
+  ASSERT(strexpr(vm, "let o = {a:1,b:2,c:3,d:4,e:'x'}; o.e", "x"));
+  CHECK_NUMERIC("o.a + o.c + o.d", 8);
+  ASSERT(js_eval(vm, "o.f", -1) == JS_UNDEFINED);
+  ASSERT(strcmp(js_stringify(vm, js_eval(vm, "o", -1)),
+                "{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":\"x\"}") == 0);
+  CHECK_NUMERIC("1 + {a:1,b:2,c:3,d:4,e:5}.c + o.b", 6);
+  // Global scope outgrows the index, and falls back to linear lookup
+  for (i = 0; i < 20; i++) {
+    snprintf(buf, sizeof(buf), "let v%d = %d;", i, i);
+    ASSERT(numexpr(vm, buf, (float) i));
+  }
+  CHECK_NUMERIC("v0 + v7 + v19 + o.b", 28);
+  ASSERT(js_set(vm, js_get_global(vm), js_mk_str(vm, "v7", 2), js_mk_num(1)) ==
+         JS_TRUE);
+  CHECK_NUMERIC("v7 + o.d", 5);
+  js_destroy(vm);
+
+  // Freed objects leave the index, and entries of live ones stay reachable
+  vm = js_create();
+  ASSERT(js_eval(vm, "let p = {a:5,b:6,c:7,d:8}, q = {d:9,c:10,b:11,a:12};",
+                 -1) != JS_ERROR);
+  ASSERT(js_eval(vm, "p = 0;", -1) != JS_ERROR);
+  js_gc(vm);
+  CHECK_NUMERIC("q.a + q.b + q.c + q.d", 42);
+  ASSERT(js_eval(vm, "p = {e:1,f:2,g:3,h:4};", -1) != JS_ERROR);
+  CHECK_NUMERIC("p.h + q.a", 16);
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_atoms(void) {
+  struct elk *vm = js_create();
+  ind_t len;
+  ASSERT(js_eval(vm, "let o1 = {abc: 1, x: 2};", -1) != JS_ERROR);
+  len = vm->stringbuf_len;
+  ASSERT(js_eval(vm, "let o2 = {x: 3, abc: 4};", -1) != JS_ERROR);
+  ASSERT(vm->stringbuf_len == len + 4);  // Only "o2" is added
+  CHECK_NUMERIC("o1.abc + o2.abc + o2.x", 8);
+  ASSERT(js_set(vm, js_get_global(vm), js_mk_str(vm, "abc", 3),
+                js_mk_num(5)) == JS_TRUE);
+  js_gc(vm);
+  ASSERT(vm->stringbuf_len == len + 4);  // Key copy is not used
+  CHECK_NUMERIC("abc + o1.abc", 6);
+  len = vm->stringbuf_len;
+  CHECK_NUMERIC("(function(zz, x){ return zz + x; })(7, 1)", 8);
+  js_gc(vm);
+  ASSERT(vm->stringbuf_len == len);
+  ASSERT(find_atom(vm, "zz", 2) == JS_UNDEFINED);
+  ASSERT(find_atom(vm, "x", 1) != JS_UNDEFINED);
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_ic(void) {
+  struct elk *vm = js_create();
+  uint32_t hits;
+  ASSERT(js_eval(vm, "let o = {a: 1, b: 2}, i = 5, r = 0;", -1) != JS_ERROR);
+  hits = vm->ic_hits;
+  CHECK_NUMERIC("while (i) { r += o.b; i--; } r", 10);
+  ASSERT(vm->ic_hits >= hits + 4 * 4);  // Repeated o, o.b, r, i lookups
+  // Member cache must not outlive its object
+  CHECK_NUMERIC("let q = function(x) { return x.a; }; q(o) + q({b: 3, a: 4})",
+                5);
+  CHECK_NUMERIC("q({a: 6}) + q({c: 1, a: 7})", 13);
+  ASSERT(js_eval(vm, "q({b: 1})", -1) == JS_UNDEFINED);
+  // Variable cache must not hide local variables
+  CHECK_NUMERIC("let t = function(c) { if (c) let i = 7; return i; }; t(0)", 0);
+  CHECK_NUMERIC("t(1)", 7);
+  CHECK_NUMERIC("t(0)", 0);
+  // Nor caller's parameters
+  CHECK_NUMERIC("let gi = function() { return i; }; gi()", 0);
+  CHECK_NUMERIC("let ci = function(a, i) { return gi(); }; ci(1, 3)", 3);
+  CHECK_NUMERIC("ci(1, 4) + gi()", 4);
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_pools(void) {
+  struct elk *vm = js_create();
+  jsval_t objs[JS_OBJ_POOL_SIZE];
+  char buf[10];
+  int i;
+  for (i = 1; i < JS_OBJ_POOL_SIZE; i++) {
+    ASSERT(js_type(objs[i] = js_mk_obj(vm)) == JS_TYPE_OBJECT);
+  }
+  ASSERT(js_mk_obj(vm) == JS_ERROR);
+  ASSERT(js_set(vm, js_get_global(vm), js_mk_str(vm, "o", 1), objs[5]) ==
+         JS_TRUE);
+  js_gc(vm);  // Frees all objects but o
+  ASSERT(vm->nobjs == 2);
+  for (i = 2; i < JS_OBJ_POOL_SIZE; i++) {
+    ASSERT(js_type(js_mk_obj(vm)) == JS_TYPE_OBJECT);
+  }
+  ASSERT(js_mk_obj(vm) == JS_ERROR);
+  js_destroy(vm);
+  vm = js_create();
+
+  // Use all props, then free and reuse them
+  for (i = 0; i < JS_PROP_POOL_SIZE; i++) {
+    snprintf(buf, sizeof(buf), "p%d", i);
+    ASSERT(js_set(vm, js_get_global(vm), js_mk_str(vm, buf, -1),
+                  js_mk_num((float) i)) == JS_TRUE);
+  }
+  ASSERT(js_set(vm, js_get_global(vm), js_mk_str(vm, "x", 1), JS_NULL) ==
+         JS_ERROR);
+  js_destroy(vm);
+  vm = js_create();
+  ASSERT(js_eval(vm, "let a = 0, o = {x: 1, y: 2};", -1) != JS_ERROR);
+  ASSERT(js_eval(vm, "let f = function(a, b, c) { return {x: a}; };", -1) !=
+         JS_ERROR);
+  for (i = 0; i < JS_OBJ_POOL_SIZE * 2; i++) {
+    CHECK_NUMERIC("f(1, 2, 3).x + f(4, 5, 6).x + o.y", 7);
+  }
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_gc(void) {
+  struct elk *vm = js_create();
+  jsval_t a = js_mk_obj(vm), b = js_mk_obj(vm);
+  int i;
+  // Unreachable cycles are collected
+  ASSERT(js_set(vm, a, js_mk_str(vm, "x", 1), b) == JS_TRUE);
+  ASSERT(js_set(vm, b, js_mk_str(vm, "y", 1), a) == JS_TRUE);
+  ASSERT(vm->nobjs == 3);
+  js_gc(vm);
+  ASSERT(vm->nobjs == 1);
+  // Rooted host variables survive, and follow their strings when they move
+  b = js_mk_str(vm, "junk", 4);
+  a = js_mk_str(vm, "kept", 4);
+  ASSERT(js_root(vm, &a) == JS_TRUE);
+  ASSERT(js_root(vm, &b) == JS_TRUE);
+  b = js_mk_obj(vm);
+  js_gc(vm);
+  ASSERT(vm->nobjs == 2);
+  ASSERT(VAL_PAYLOAD(a) == 0);
+  ASSERT(memcmp(js_to_str(vm, a, NULL), "kept", 4) == 0);
+  js_unroot(vm, &a);
+  js_unroot(vm, &b);
+  js_gc(vm);
+  ASSERT(vm->nobjs == 1 && vm->stringbuf_len == 0);
+  for (i = 0; i < JS_ROOT_SIZE; i++) ASSERT(js_root(vm, &a) == JS_TRUE);
+  ASSERT(js_root(vm, &a) == JS_ERROR);
+  for (i = 0; i < JS_ROOT_SIZE; i++) js_unroot(vm, &a);
+  ASSERT(vm->nroots == 0);
+  // Reachable objects and their strings survive
+  ASSERT(js_eval(vm, "let o = {s: 'hi', p: {q: 'there'}};", -1) != JS_ERROR);
+  js_gc(vm);
+  ASSERT(vm->nobjs == 3);
+  ASSERT(strexpr(vm, "o.s + ' ' + o.p.q", "hi there"));
+  // Garbage produced by a loop is collected while the loop runs
+  for (i = 0; i < 5; i++) {
+    CHECK_NUMERIC("{ let i = 40; while (i) { let t = {u: i}; o.s + 'xy'; i--; } }"
+                  " 7", 7);
+  }
+  ASSERT(strexpr(vm, "o.s + ' ' + o.p.q", "hi there"));
+  // Instructions that run out of memory collect garbage and run again
+  vm->gc_objs = vm->lim.objs, vm->gc_props = vm->lim.props;
+  vm->gc_strings = vm->lim.strings;
+  CHECK_NUMERIC("{ let i = 200; while (i) { let t = {u: i}; o.s + 'xy'; i--; } }"
+                " 7", 7);
+  js_destroy(vm);
+
+  // Pools full of live data are not collected on every instruction
+  vm = js_create();
+  for (i = 0; i < JS_OBJ_POOL_SIZE; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "k%d", i);
+    if (js_set(vm, js_get_global(vm), js_mk_str(vm, key, -1),
+               js_mk_obj(vm)) == JS_ERROR) {
+      break;
+    }
+  }
+  js_gc(vm);
+  ASSERT(!gc_needed(vm));
+  js_destroy(vm);
+
+  // Live strings interleaved with garbage of different sizes are moved
+  // and forwarded correctly, with more gaps than the forwarding table has
+  vm = js_create();
+  for (i = 0; i < JS_GC_FWD_SIZE * 3; i++) {
+    char key[16], val[16];
+    snprintf(key, sizeof(key), "k%d", i);
+    snprintf(val, sizeof(val), "v%d", i * 7);
+    js_mk_str(vm, "garbage", i % 5 + 1);
+    ASSERT(js_set(vm, js_get_global(vm), js_mk_str(vm, key, -1),
+                  js_mk_str(vm, val, -1)) == JS_TRUE);
+  }
+  js_gc(vm);
+  for (i = 0; i < JS_GC_FWD_SIZE * 3; i++) {
+    char expr[20], val[16];
+    snprintf(expr, sizeof(expr), "k%d", i);
+    snprintf(val, sizeof(val), "v%d", i * 7);
+    ASSERT(strexpr(vm, expr, val));
+  }
+  js_destroy(vm);
+  return NULL;
+}
+
+static const char *test_create_in(void) {
+  struct js_limits small = {4, 3, 3, 8, 65, 256, 0, 8, 0, 1};
+  struct js_limits big = {10, 10, 20, 30, 512, 1024, 8, 32, 4, 4};
+  static union js_align slab[1024];
+  unsigned long small_size = js_size(&small), big_size = js_size(&big);
+  struct elk *a, *b;
+  ASSERT(small_size > 0 && small_size < big_size);
+  ASSERT(small_size + big_size <= sizeof(slab));
+  ASSERT(js_size(NULL) > 0);
+  ASSERT(small_size % VM_ALIGN == 0);
+  ASSERT(js_create_in(slab, small_size - 1, &small) == NULL);
+  ASSERT(js_create_in((char *) slab + 1, small_size, &small) == NULL);
+  small.objs = 0;
+  ASSERT(js_size(&small) == 0);
+  small.objs = 3;
+
+  // Pack two VMs of different sizes back to back
+  a = js_create_in(slab, small_size, &small);
+  b = js_create_in((char *) slab + small_size, big_size, &big);
+  ASSERT(a != NULL && b != NULL);
+  ASSERT(a->lim.objs == 3 && b->lim.objs == 20);
+  ASSERT(js_eval(a, "let x = 1;", -1) != JS_ERROR);
+  ASSERT(js_eval(b, "let x = 2, o = {a: {b: {c: 3}}};", -1) != JS_ERROR);
+  ASSERT(js_eval(a, "let o = {a: {b: {c: 3}}};", -1) == JS_ERROR);
+  ASSERT(numexpr(a, "x", 1));
+  ASSERT(numexpr(b, "x + o.a.b.c", 5));
+  ASSERT(strexpr(a, "'abc' + 'def'", "abcdef"));
+  ASSERT(js_mk_buf(a, slab, 4, JS_BUF_U8) != JS_ERROR);
+  ASSERT(js_mk_buf(a, slab, 4, JS_BUF_U8) == JS_ERROR);  // One handle
+  ASSERT(js_eval(a, "('0123456789012345678901234567890123456789' + 'abc')[0]",
+                 -1) == JS_ERROR);
+  ASSERT(typeexpr(b, "'0123456789012345678901234567890123456789' + 'abc'",
+                  JS_TYPE_STRING));
+  js_destroy(a);  // Does not free the slab
+  js_destroy(b);
+  return NULL;
+}
+
+static const char *test_smi(void) {
+  struct elk *vm = js_create();
+  jsval_t v;
+  js_ffi(vm, tostr, "smj");
+  ASSERT(IS_SMI(js_eval(vm, "1 + 2", -1)));
+  ASSERT(IS_SMI(js_mk_num(-7)));
+#ifndef JS_NUM_INT32
+  ASSERT(!IS_SMI(js_eval(vm, "1.5", -1)));
+  ASSERT(IS_SMI(js_eval(vm, "1.5 + 1.5", -1)));
+  CHECK_NUMERIC("7 / 2", 3.5);
+
+  // Bitwise ops wrap modulo 2^32, and huge or non-finite indices miss
+  ASSERT(js_eval(vm, "~4294967296", -1) == MK_SMI(-1));
+  ASSERT(js_eval(vm, "~(0 - 4294967296)", -1) == MK_SMI(-1));
+  ASSERT(js_eval(vm, "~(1 / 0)", -1) == MK_SMI(-1));
+  v = js_eval(vm, "~1e30", -1);
+  ASSERT(js_to_float(v) >= -2147483648.0 && js_to_float(v) < 2147483648.0);
+  ASSERT(js_eval(vm, "let ia = [1]; ia[1e30]", -1) == JS_UNDEFINED);
+  ASSERT(js_eval(vm, "ia[0 / 0]", -1) == JS_UNDEFINED);
+  ASSERT(js_eval(vm, "'abc'[1e30]", -1) == JS_UNDEFINED);
+  ASSERT(js_eval(vm, "'abc'[0 - 1e30]", -1) == JS_UNDEFINED);
+  ASSERT(js_eval(vm, "ia[0 - 1e30] = 1", -1) == JS_ERROR);
+  ASSERT(js_eval(vm, "ia[1e30] = 1", -1) == JS_ERROR);
+#endif
+  ASSERT(js_eval(vm, "6 / 2", -1) == MK_SMI(3));
+  ASSERT(js_eval(vm, "-7 % 3", -1) == MK_SMI(-1));
+  ASSERT(js_eval(vm, "7 % -3", -1) == MK_SMI(1));
+  ASSERT(js_eval(vm, "5 & 3", -1) == MK_SMI(1));
+  ASSERT(js_eval(vm, "5 | 3", -1) == MK_SMI(7));
+  ASSERT(js_eval(vm, "5 ^ 3", -1) == MK_SMI(6));
+  ASSERT(js_eval(vm, "~5", -1) == MK_SMI(-6));
+  ASSERT(js_eval(vm, "-8 >> 1", -1) == MK_SMI(-4));
+  ASSERT(js_eval(vm, "-1 >>> 28", -1) == MK_SMI(15));
+  ASSERT(js_eval(vm, "-(3)", -1) == MK_SMI(-3));
+
+#if defined(JS_NUM_INT32)
+  // Integer math: truncate, saturate, no division by zero
+  ASSERT(js_eval(vm, "7 / 2", -1) == MK_SMI(3));
+  ASSERT(js_eval(vm, "-7 / 2", -1) == MK_SMI(-3));
+  ASSERT(js_eval(vm, "7 / 0", -1) == MK_SMI(0));
+  ASSERT(js_eval(vm, "7 % 0", -1) == MK_SMI(0));
+  ASSERT(js_eval(vm, "1.9 + 0.9", -1) == MK_SMI(1));
+  ASSERT(js_eval(vm, "1e3", -1) == JS_ERROR);
+  v = js_eval(vm, "65536 * 65536", -1);
+  ASSERT(v == MK_SMI(SMI_MAX) && js_to_float(v) == 0x7f7fffff);
+  ASSERT(js_eval(vm, "0x7f7fffff + 1", -1) == MK_SMI(SMI_MAX));
+  ASSERT(js_eval(vm, "-65536 * 65536", -1) == MK_SMI(SMI_MIN));
+  ASSERT(js_eval(vm, "-65536 * 65536 - 1", -1) == MK_SMI(SMI_MIN));
+  ASSERT(js_eval(vm, "-(-65536 * 65536)", -1) == MK_SMI(SMI_MAX));
+  ASSERT(js_eval(vm, "-65536 * 65536 / -1", -1) == MK_SMI(SMI_MAX));
+  ASSERT(js_eval(vm, "-1 >>> 0", -1) == MK_SMI(SMI_MAX));
+  ASSERT(js_eval(vm, "1 << 31", -1) == MK_SMI(SMI_MIN));
+  ASSERT(js_eval(vm, "~(0 - 0x7f7fffff - 2)", -1) == MK_SMI(SMI_MAX));
+  ASSERT(strexpr(vm, "tostr(0, -65536 * 65536)", "-2147483648"));
+  ASSERT(strexpr(vm, "tostr(0, 0x7f7fffff)", "2139095039"));
+  ASSERT(js_type(js_mk_num(SMI_MIN)) == JS_TYPE_NUMBER);
+#elif defined(JS_VAL64)
+  // Results that do not fit fall back to float
+  v = js_eval(vm, "2147483647 + 1", -1);
+  ASSERT(!IS_SMI(v) && js_to_float(v) == 2147483648.0);
+  ASSERT(js_eval(vm, "2147483648 - 1", -1) == MK_SMI(2147483647));
+  ASSERT(js_eval(vm, "-65536 * 32768", -1) == MK_SMI(SMI_MIN));
+  CHECK_NUMERIC("-65536 * 32768 - 2147483647", -4294967295.0);
+  CHECK_NUMERIC("-65536 * 32768 / -1", 2147483648.0);
+  CHECK_NUMERIC("-65536 * 32768 % -1", 0);
+  v = js_eval(vm, "65536 * 65536 * 4", -1);
+  ASSERT(!IS_SMI(v) && js_to_float(v) == 17179869184.0);
+  // Exact integers beyond int32
+  CHECK_NUMERIC("0xffffffff", 4294967295.0);
+  CHECK_NUMERIC("-1 >>> 0", 4294967295.0);
+  ASSERT(js_eval(vm, "0xffffffff & 0xff", -1) == MK_SMI(255));
+  CHECK_NUMERIC("1700000000 * 1000 + 1", 1700000000001.0);
+  ASSERT(strexpr(vm, "tostr(0, 1700000000 * 1000 + 1)", "1700000000001"));
+  ASSERT(strexpr(vm, "tostr(0, 0.1 + 0.2)", "0.30000000000000004"));
+#else
+  // Results that do not fit fall back to float
+  v = js_eval(vm, "1048575 + 1", -1);
+  ASSERT(!IS_SMI(v) && js_to_float(v) == 1048576.0f);
+  ASSERT(js_eval(vm, "1048576 - 1", -1) == MK_SMI(1048575));
+  v = js_eval(vm, "1 << 20", -1);
+  ASSERT(!IS_SMI(v) && js_to_float(v) == 1048576.0f);
+  v = js_eval(vm, "1024 * 1024 * 4", -1);
+  ASSERT(!IS_SMI(v) && js_to_float(v) == 4194304.0f);
+#endif
+#ifndef JS_NUM_INT32
+  ASSERT(js_to_float(js_eval(vm, "1 / -(0)", -1)) < -FLT_MAX);
+  ASSERT(js_to_float(js_eval(vm, "1 / (0 * -5)", -1)) < -FLT_MAX);
+  CHECK_NUMERIC("5.5 % 2", 1.5);
+  CHECK_NUMERIC("-5.5 % 2", -1.5);
+  CHECK_NUMERIC("-1.5 | 0", -1);
+#endif
+
+  // Counters stay integers
+  ASSERT(js_eval(vm, "let i = 100, s = 0;", -1) != JS_ERROR);
+  ASSERT(js_eval(vm, "while (i) { s += i; i--; } s", -1) == MK_SMI(5050));
+  ASSERT(js_eval(vm, "s *= 3; s >>= 1; s", -1) == MK_SMI(7575));
+  js_destroy(vm);
+  return NULL;
+}
+
 static const char *run_all_tests(void) {
   RUN_TEST(test_stringify);
   RUN_TEST(test_if);
   RUN_TEST(test_strings);
+  RUN_TEST(test_rope);
+  RUN_TEST(test_long_strings);
   RUN_TEST(test_expr);
+  RUN_TEST(test_smi);
   RUN_TEST(test_ffi);
+  RUN_TEST(test_import);
+  RUN_TEST(test_pointer);
+  RUN_TEST(test_buffer);
+  RUN_TEST(test_array);
+  RUN_TEST(test_call);
   RUN_TEST(test_subscript);
   RUN_TEST(test_scopes);
   RUN_TEST(test_function);
+  RUN_TEST(test_frames);
   RUN_TEST(test_objects);
+  RUN_TEST(test_prop_index);
+  RUN_TEST(test_atoms);
+  RUN_TEST(test_ic);
+  RUN_TEST(test_pools);
+  RUN_TEST(test_gc);
+  RUN_TEST(test_create_in);
   RUN_TEST(test_notsupported);
   RUN_TEST(test_comments);
+  RUN_TEST(test_compile);
+  RUN_TEST(test_tokens);
   return NULL;
 }
 